@@ -5,6 +5,7 @@ import platform
 # from PyQt5.QtCore import *
 from PyQt5.QtWidgets import *
 import serial
+import struct
 from serial.tools import list_ports
 import time
 
@@ -43,6 +44,36 @@ def reader_connect():
         error = "AttributeError in Python, cannot detect reader"
         print(error)
 
+def reader_hello(reader, timeout=5):
+    # Wait for the capabilities the reader sends once it is out of reset
+    # Ask for them with <h> if it was already running (no reset on connect)
+    deadline = time.time() + timeout
+    asked = False
+    while time.time() < deadline:
+        transmission = reader.readline()[0:-2].decode('utf-8', 'replace')
+        if transmission.startswith('#hello,'):
+            return dict(field.split('=', 1) for field in transmission.split(',')[1:] if '=' in field)
+        if not transmission and not asked:
+            reader.write(b'<h>')
+            asked = True
+    return None
+
+
+def reader_setup(reader, setup_commands, timeout=5):
+    # Send the setup message and return once the reader acknowledges it, False if rejected or unanswered
+    reader.write(setup_commands.encode())
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        transmission = reader.readline()[0:-2].decode('utf-8', 'replace')
+        if transmission.startswith('#ack'):
+            return True
+        if transmission == '#nak':
+            return False
+        if transmission:
+            print(transmission)
+    return False
+
+
 def data_save(reader):
     fieldnames = ['time', 'sen1Ch1', 'sen1Ch2', 'sen1Ch3', 'sen1Ch4', 'sen1Ch5',
                   'sen2Ch1', 'sen2Ch2', 'sen2Ch3', 'sen2Ch4', 'sen2Ch5', 'cnt1', 'cnt2']
@@ -78,6 +109,76 @@ def data_print(reader):
             break
 
 
+# Waveform segment flags, see README
+SEGMENT_CAPACITY = 48
+SEGMENT_FINAL = 0x01
+SEGMENT_REPEAT = 0x02
+
+
+def pack_segment(points, flags):
+    # points: list of (dac_index, dwell) with dwell in 10 us units
+    payload = b''.join(struct.pack('<HH', index, dwell) for index, dwell in points)
+    checksum = (len(points) + flags + sum(payload)) & 0xFF
+    return b'{' + bytes([len(points), flags]) + payload + bytes([checksum]) + b'}'
+
+
+def waveform_stream(reader, points, repeat=False):
+    # Split waveform into segments and upload one each time the reader frees a buffer
+    chunks = [points[i:i + SEGMENT_CAPACITY] for i in range(0, len(points), SEGMENT_CAPACITY)]
+    frames = []
+    for i, chunk in enumerate(chunks):
+        last = i == len(chunks) - 1
+        flags = (SEGMENT_REPEAT if repeat else SEGMENT_FINAL) if last else 0
+        frames.append(pack_segment(chunk, flags))
+
+    # One frame in flight at a time: the reader stores frames in arrival order, so a frame sent
+    # behind a rejected one would take its place and a resend could no longer restore the order
+    sent = 0
+    free_buffers = 0
+    in_flight = None
+    while True:
+        transmission = reader.readline()[0:-2].decode('utf-8')
+        if not transmission:
+            print("Finished")
+            break
+
+        if transmission == '#next':
+            free_buffers += 1
+        elif transmission == '#seg,ok':
+            in_flight = None
+        elif transmission == '#seg,err' and in_flight is not None:
+            reader.write(in_flight)
+        else:
+            print(transmission)
+
+        if in_flight is None and free_buffers > 0 and sent < len(frames):
+            in_flight = frames[sent]
+            reader.write(in_flight)
+            sent += 1
+            free_buffers -= 1
+
+
+# DAC index per mV of gate potential, as in setupDAC()
+DAC_GROUND = 2048
+DAC_STEP_MV = 2.0 * 1182.0 / 4096
+
+
+def square_wave(median, amplitude, frequency):
+    # One period of a square wave around median (mV), frequency in mHz, as waveform points
+    high = DAC_GROUND + int((median + amplitude) / DAC_STEP_MV)
+    low = DAC_GROUND + int((median - amplitude) / DAC_STEP_MV)
+    half = int(round(1.0e8 / frequency / 2))  # Half period in 10 us units
+    points = []
+    for index in (high, low):
+        # Dwell is a uint16, so long halves are held over several points
+        remaining = half
+        while remaining > 0:
+            dwell = min(remaining, 0xFFFF)
+            points.append((index, dwell))
+            remaining -= dwell
+    return points
+
+
 class Window(QMainWindow):
     """
     Example for microcontroller cross-talk.
@@ -92,11 +193,15 @@ class Window(QMainWindow):
         self.lbl_gate_median = QLabel("Gate median potential (mV)")
         self.lbl_gate_amplitude = QLabel("Gate amplitude potential (mV)")
         self.lbl_freq = QLabel("Sweep frequency (mHz)")
+        self.lbl_window = QLabel("Event window half-width (nA)")
+        self.lbl_heartbeat = QLabel("Event heartbeat period (s)")
 
         self.txt_reader_setting = QLineEdit("s")
         self.txt_gate_median = QLineEdit("500")
         self.txt_gate_amplitude = QLineEdit("100")
         self.txt_freq = QLineEdit("1000")
+        self.txt_window = QLineEdit("50")
+        self.txt_heartbeat = QLineEdit("10")
 
         self.btn_setup = QPushButton("Setup")
 
@@ -122,7 +227,13 @@ class Window(QMainWindow):
         self.layout.addWidget(self.lbl_freq, 3, 0)
         self.layout.addWidget(self.txt_freq, 3, 1)
 
-        self.layout.addWidget(self.btn_setup, 4, 0, 1, 2)
+        self.layout.addWidget(self.lbl_window, 4, 0)
+        self.layout.addWidget(self.txt_window, 4, 1)
+
+        self.layout.addWidget(self.lbl_heartbeat, 5, 0)
+        self.layout.addWidget(self.txt_heartbeat, 5, 1)
+
+        self.layout.addWidget(self.btn_setup, 6, 0, 1, 2)
 
         self.show()
 
@@ -134,28 +245,39 @@ class Window(QMainWindow):
         median = self.txt_gate_median.text()
         amplitude = self.txt_gate_amplitude.text()
         frequency = self.txt_freq.text()
+        debug = '0'
+        window = self.txt_window.text()
+        heartbeat = self.txt_heartbeat.text()
 
-        setup_commands = '<' + setting + ';' + median + ';' + amplitude + ';' + frequency + '>'
+        setup_commands = '<' + setting + ';' + median + ';' + amplitude + ';' + frequency + ';' + debug + ';' + \
+                         window + ';' + heartbeat + '>'
         print("Setup: " + setup_commands)
         return setup_commands
 
     def main(self):
         # Connect reader
         reader = reader_connect()
-        time.sleep(1)
 
-        # Confirm ready statement from reader
-        transmission = reader.readline()[0:-2].decode("utf-8")
-        # transmission = reader.readline().decode('ascii').strip()
-        print(transmission)
+        # Wait for the reader to announce itself instead of a fixed delay
+        capabilities = reader_hello(reader)
+        if capabilities is None:
+            print("Reader did not announce itself")
+            return
+        print("Reader capabilities: " + str(capabilities))
 
-        # Pass setup commands
+        # Pass setup commands, data follows the acknowledgement
         setup_commands = self.package_setup_commands()
-        reader.write(setup_commands.encode())
-        time.sleep(1)
-
-        # Print incoming data
-        data_print(reader)
+        if not reader_setup(reader, setup_commands):
+            print("Reader did not accept setup: " + setup_commands)
+            return
+
+        # Print incoming data, serving waveform segments in waveform mode
+        if self.txt_reader_setting.text() == 'w':
+            points = square_wave(float(self.txt_gate_median.text()), float(self.txt_gate_amplitude.text()),
+                                 float(self.txt_freq.text()))
+            waveform_stream(reader, points, repeat=True)
+        else:
+            data_print(reader)
 
 
 if __name__ == '__main__':
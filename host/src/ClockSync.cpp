@@ -0,0 +1,108 @@
+#include "ClockSync.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+bool ClockSync::parseReply(const std::string &line, Reply &reply)
+{
+  unsigned long received;
+  unsigned long elapsed;
+  unsigned long sent;
+  if (std::sscanf(line.c_str(), "#sync,%ld,%lu,%lu,%lu", &reply.sequence, &received, &elapsed, &sent) != 4)
+  {
+    return false;
+  }
+  reply.received = received;
+  reply.elapsed = elapsed;
+  reply.sent = sent;
+  return true;
+}
+
+ClockSync::ClockSync(size_t groupSize)
+    : m_groupSize(groupSize > 0 ? groupSize : 1), m_lastMicros(0), m_wraps(0), m_unwrapped(false), m_readerMean(0),
+      m_hostMean(0), m_slope(1), m_residual(0), m_minRoundTrip(0), m_used(0)
+{
+}
+
+int64_t ClockSync::unwrap(uint32_t micros)
+{
+  // A time far below the last one has wrapped; a slightly lower one is just out of order
+  if (m_unwrapped && micros < m_lastMicros && m_lastMicros - micros > 0x80000000UL)
+  {
+    m_wraps++;
+  }
+  m_unwrapped = true;
+  m_lastMicros = micros;
+  return (m_wraps << 32) + micros;
+}
+
+void ClockSync::add(const Exchange &exchange)
+{
+  m_exchanges.push_back(exchange);
+}
+
+bool ClockSync::fit()
+{
+  if (m_exchanges.empty())
+  {
+    return false;
+  }
+
+  // Keep the fastest exchange of every group
+  std::vector<const Exchange *> kept;
+  m_minRoundTrip = m_exchanges.front().roundTrip();
+  for (size_t begin = 0; begin < m_exchanges.size(); begin += m_groupSize)
+  {
+    size_t end = std::min(begin + m_groupSize, m_exchanges.size());
+    const Exchange *best = &m_exchanges[begin];
+    for (size_t i = begin; i < end; i++)
+    {
+      if (m_exchanges[i].roundTrip() < best->roundTrip())
+      {
+        best = &m_exchanges[i];
+      }
+    }
+    kept.push_back(best);
+    m_minRoundTrip = std::min(m_minRoundTrip, best->roundTrip());
+  }
+  m_used = kept.size();
+
+  // Least squares line through the midpoints, centered so microsecond times keep their precision
+  double readerSum = 0;
+  double hostSum = 0;
+  for (const Exchange *exchange : kept)
+  {
+    readerSum += 0.5 * (exchange->readerReceived + exchange->readerSent);
+    hostSum += 0.5 * (exchange->hostSent + exchange->hostReceived);
+  }
+  m_readerMean = readerSum / kept.size();
+  m_hostMean = hostSum / kept.size();
+
+  double sxx = 0;
+  double sxy = 0;
+  for (const Exchange *exchange : kept)
+  {
+    double x = 0.5 * (exchange->readerReceived + exchange->readerSent) - m_readerMean;
+    double y = 0.5 * (exchange->hostSent + exchange->hostReceived) - m_hostMean;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  // One group, or all in a moment: offset only
+  m_slope = (kept.size() > 1 && sxx > 0) ? sxy / sxx : 1.0;
+
+  double squares = 0;
+  for (const Exchange *exchange : kept)
+  {
+    double error = toHost(0.5 * (exchange->readerReceived + exchange->readerSent)) -
+                   0.5 * (exchange->hostSent + exchange->hostReceived);
+    squares += error * error;
+  }
+  m_residual = std::sqrt(squares / kept.size());
+  return true;
+}
+
+double ClockSync::toHost(double readerMicros) const
+{
+  return m_hostMean + m_slope * (readerMicros - m_readerMean);
+}
@@ -0,0 +1,82 @@
+#ifndef ClockSync_h
+#define ClockSync_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+  Estimates how a reader clock maps onto the host clock from ping exchanges.
+
+  The host sends <y;seq> at host time t1 and reads the answer
+  #sync,seq,t2,elapsed,t3 at host time t4. t2 and t3 are the reader micros()
+  when the ping arrived and when the answer was written. Serial latency and
+  the reader's loop only ever add delay, so the exchanges with the shortest
+  round trip (t4 - t1) - (t3 - t2) are the ones where the midpoints
+  (t1 + t4) / 2 and (t2 + t3) / 2 are the same instant. Exchanges are taken in
+  groups, the fastest of each group is kept, and a line fitted through the kept
+  midpoints gives the offset and the drift of the reader crystal.
+
+  micros() wraps every 71.6 minutes; unwrap() extends it to 64 bits, so feed
+  it reader times in the order they were sent.
+*/
+class ClockSync
+{
+public:
+  struct Exchange
+  {
+    int64_t hostSent;       // t1, host us
+    int64_t readerReceived; // t2, reader us (unwrapped)
+    int64_t readerSent;     // t3, reader us (unwrapped)
+    int64_t hostReceived;   // t4, host us
+
+    int64_t roundTrip() const { return (hostReceived - hostSent) - (readerSent - readerReceived); }
+  };
+
+  struct Reply
+  {
+    long sequence;
+    uint32_t received; // Reader micros() when the ping arrived
+    uint32_t elapsed;  // Reader experiment time (ms), the time base of its records
+    uint32_t sent;     // Reader micros() when the answer was written
+  };
+
+  // Parse a #sync line. Returns false for any other line
+  static bool parseReply(const std::string &line, Reply &reply);
+
+  explicit ClockSync(size_t groupSize = 8);
+
+  int64_t unwrap(uint32_t micros);
+  void add(const Exchange &exchange);
+
+  // Fit offset and drift to the exchanges so far. Returns false without any exchange
+  bool fit();
+
+  // Host time of a reader time, both us
+  double toHost(double readerMicros) const;
+
+  // Reader clock rate error in ppm, positive when the reader runs fast
+  double drift() const { return (1.0 / m_slope - 1.0) * 1e6; }
+  double residual() const { return m_residual; }
+  int64_t minRoundTrip() const { return m_minRoundTrip; }
+  size_t exchanges() const { return m_exchanges.size(); }
+  size_t used() const { return m_used; }
+
+private:
+  size_t m_groupSize;
+  std::vector<Exchange> m_exchanges;
+  uint32_t m_lastMicros;
+  int64_t m_wraps;
+  bool m_unwrapped; // A reader time was unwrapped before
+
+  // host = m_hostMean + m_slope * (reader - m_readerMean)
+  double m_readerMean;
+  double m_hostMean;
+  double m_slope;
+  double m_residual; // RMS distance of the kept exchanges from the fit (us)
+  int64_t m_minRoundTrip;
+  size_t m_used;
+};
+
+#endif
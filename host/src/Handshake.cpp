@@ -0,0 +1,98 @@
+#include "Handshake.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <stdexcept>
+
+static long long hostMillis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string Capabilities::get(const std::string &key) const
+{
+  std::map<std::string, std::string>::const_iterator it = fields.find(key);
+  return it == fields.end() ? std::string() : it->second;
+}
+
+bool parseHello(const std::string &line, Capabilities &capabilities)
+{
+  if (line.compare(0, 7, "#hello,") != 0)
+  {
+    return false;
+  }
+  capabilities.fields.clear();
+  size_t begin = 7;
+  while (begin < line.size())
+  {
+    size_t end = line.find(',', begin);
+    if (end == std::string::npos)
+    {
+      end = line.size();
+    }
+    size_t equals = line.find('=', begin);
+    if (equals < end)
+    {
+      capabilities.fields[line.substr(begin, equals - begin)] = line.substr(equals + 1, end - equals - 1);
+    }
+    begin = end + 1;
+  }
+  return true;
+}
+
+bool waitHello(SerialPort &port, Capabilities &capabilities, int timeout)
+{
+  // The bootloader keeps the reader quiet for about a second after reset, only ask once that has passed
+  long long deadline = hostMillis() + timeout;
+  long long ask = hostMillis() + timeout / 2;
+  bool asked = false;
+  std::string line;
+  long long now;
+  while ((now = hostMillis()) < deadline)
+  {
+    long long wait = asked ? deadline - now : ask - now;
+    if (wait > 0 && port.readLine(line, (int)wait))
+    {
+      if (parseHello(line, capabilities))
+      {
+        return true;
+      }
+      continue;
+    }
+    if (!port.terminal())
+    {
+      return false; // A capture ended without a hello
+    }
+    if (!asked && hostMillis() >= ask)
+    {
+      port.write("<h>");
+      asked = true;
+    }
+  }
+  return false;
+}
+
+void sendSetup(SerialPort &port, const std::string &message, int timeout)
+{
+  port.write(message);
+  long long deadline = hostMillis() + timeout;
+  std::string line;
+  long long now;
+  while ((now = hostMillis()) < deadline)
+  {
+    if (!port.readLine(line, (int)(deadline - now)))
+    {
+      break;
+    }
+    if (line.compare(0, 4, "#ack") == 0)
+    {
+      return;
+    }
+    if (line == "#nak")
+    {
+      throw std::runtime_error("reader rejected " + message);
+    }
+  }
+  throw std::runtime_error("reader did not acknowledge " + message);
+}
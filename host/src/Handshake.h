@@ -0,0 +1,37 @@
+#ifndef Handshake_h
+#define Handshake_h
+
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "SerialPort.h"
+
+/*
+  Capability handshake with a reader. The reader sends
+
+    #hello,version=1,modes=csepw,formats=01,...,queue=8,segment=48,tx=64,baud=500000,sync=1
+
+  once it is out of reset, and again on <h>. A setup message is answered with
+  #ack,<setting> once the configuration is in effect, or #nak if the setting
+  is unknown. Records of the new configuration follow the ack.
+*/
+struct Capabilities
+{
+  std::map<std::string, std::string> fields;
+
+  int version() const { return std::atoi(get("version").c_str()); }
+  bool supports(const std::string &key, char value) const { return get(key).find(value) != std::string::npos; }
+  std::string get(const std::string &key) const;
+};
+
+// Parse a #hello line. Returns false for any other line
+bool parseHello(const std::string &line, Capabilities &capabilities);
+
+// Wait for the hello a reader sends after reset, asking with <h> if it stays quiet (no reset on open)
+bool waitHello(SerialPort &port, Capabilities &capabilities, int timeout = 3000);
+
+// Send a setup message and wait for the ack. Throws if the reader rejects it or does not answer
+void sendSetup(SerialPort &port, const std::string &message, int timeout = 3000);
+
+#endif
@@ -0,0 +1,288 @@
+#include "Recording.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace wozrec
+{
+
+static uint64_t padded(uint64_t size)
+{
+  return (size + 7) & ~(uint64_t)7;
+}
+
+uint64_t chunkDataSize(uint32_t count)
+{
+  return padded(count * sizeof(int64_t)) + padded(count * sizeof(int16_t)) + 2 * padded(count * sizeof(uint16_t)) +
+         padded(count * sizeof(uint8_t));
+}
+
+RecordingWriter::RecordingWriter(const std::string &path, double rRef, uint32_t chunkCapacity)
+    : m_offset(0), m_rows(0), m_chunkCapacity(chunkCapacity > 0 ? chunkCapacity : defaultChunkCapacity)
+{
+  m_file = std::fopen(path.c_str(), "wb");
+  if (!m_file)
+  {
+    throw std::runtime_error("cannot create " + path);
+  }
+
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+  header.version = formatVersion;
+  header.chunkCapacity = m_chunkCapacity;
+  header.rRef = rRef;
+  write(&header, sizeof(header));
+
+  m_time.reserve(m_chunkCapacity);
+  m_code.reserve(m_chunkCapacity);
+  m_indexDAC.reserve(m_chunkCapacity);
+  m_range.reserve(m_chunkCapacity);
+  m_channel.reserve(m_chunkCapacity);
+}
+
+RecordingWriter::~RecordingWriter()
+{
+  if (m_file)
+  {
+    try
+    {
+      close();
+    }
+    catch (const std::exception &)
+    {
+      // Nothing to report to from a destructor; the reader rebuilds the index
+    }
+  }
+}
+
+void RecordingWriter::write(const void *data, size_t size)
+{
+  if (std::fwrite(data, 1, size, m_file) != size)
+  {
+    throw std::runtime_error("write failed");
+  }
+  m_offset += size;
+}
+
+void RecordingWriter::append(const Row &row)
+{
+  if (!m_time.empty() && row.time < m_time.back())
+  {
+    throw std::invalid_argument("timestamps must not decrease");
+  }
+  if (m_time.empty() && !m_index.empty() && row.time < m_index.back().timeLast)
+  {
+    throw std::invalid_argument("timestamps must not decrease");
+  }
+
+  m_time.push_back(row.time);
+  m_code.push_back(row.code);
+  m_indexDAC.push_back(row.indexDAC);
+  m_range.push_back(row.range);
+  m_channel.push_back(row.channel);
+  m_rows++;
+
+  if (m_time.size() == m_chunkCapacity)
+  {
+    flush();
+  }
+}
+
+void RecordingWriter::flush()
+{
+  if (!m_file || m_time.empty())
+  {
+    return;
+  }
+
+  uint32_t count = m_time.size();
+  ChunkHeader header;
+  std::memcpy(header.magic, chunkMagic, sizeof(header.magic));
+  header.count = count;
+  header.timeFirst = m_time.front();
+  header.timeLast = m_time.back();
+  header.size = chunkDataSize(count);
+
+  IndexEntry entry = {header.timeFirst, header.timeLast, m_offset, count, 0};
+  write(&header, sizeof(header));
+
+  // Each column padded to 8 bytes, so every column of a mapped chunk is aligned
+  static const uint8_t padding[8] = {0};
+  auto column = [&](const void *data, size_t size) {
+    write(data, size);
+    write(padding, padded(size) - size);
+  };
+  column(m_time.data(), count * sizeof(int64_t));
+  column(m_code.data(), count * sizeof(int16_t));
+  column(m_indexDAC.data(), count * sizeof(uint16_t));
+  column(m_range.data(), count * sizeof(uint16_t));
+  column(m_channel.data(), count * sizeof(uint8_t));
+  std::fflush(m_file);
+
+  m_index.push_back(entry);
+  m_time.clear();
+  m_code.clear();
+  m_indexDAC.clear();
+  m_range.clear();
+  m_channel.clear();
+}
+
+void RecordingWriter::close()
+{
+  if (!m_file)
+  {
+    return;
+  }
+  flush();
+
+  IndexTrailer trailer;
+  trailer.offset = m_offset;
+  trailer.count = m_index.size();
+  std::memcpy(trailer.magic, indexMagic, sizeof(trailer.magic));
+  if (!m_index.empty())
+  {
+    write(m_index.data(), m_index.size() * sizeof(IndexEntry));
+  }
+  write(&trailer, sizeof(trailer));
+
+  int result = std::fclose(m_file);
+  m_file = NULL;
+  if (result != 0)
+  {
+    throw std::runtime_error("close failed");
+  }
+}
+
+RecordingReader::RecordingReader(const std::string &path) : m_data(NULL), m_size(0), m_indexed(false)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+  {
+    throw std::runtime_error("cannot open " + path);
+  }
+  struct stat status;
+  if (::fstat(fd, &status) != 0 || (size_t)status.st_size < sizeof(FileHeader))
+  {
+    ::close(fd);
+    throw std::runtime_error(path + " is not a recording");
+  }
+  m_size = status.st_size;
+  void *data = ::mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+  {
+    throw std::runtime_error("cannot map " + path);
+  }
+  m_data = static_cast<const uint8_t *>(data);
+
+  m_header = reinterpret_cast<const FileHeader *>(m_data);
+  if (std::memcmp(m_header->magic, fileMagic, sizeof(fileMagic)) != 0 || m_header->version != formatVersion)
+  {
+    ::munmap(const_cast<uint8_t *>(m_data), m_size);
+    throw std::runtime_error(path + " is not a recording of a supported version");
+  }
+
+  // Trust the trailer only if its index lies inside the file and ends right before it
+  const IndexTrailer *trailer = reinterpret_cast<const IndexTrailer *>(m_data + m_size - sizeof(IndexTrailer));
+  if (m_size >= sizeof(FileHeader) + sizeof(IndexTrailer) &&
+      std::memcmp(trailer->magic, indexMagic, sizeof(indexMagic)) == 0 && trailer->offset >= sizeof(FileHeader) &&
+      trailer->offset + (uint64_t)trailer->count * sizeof(IndexEntry) + sizeof(IndexTrailer) == m_size)
+  {
+    const IndexEntry *entries = reinterpret_cast<const IndexEntry *>(m_data + trailer->offset);
+    m_index.assign(entries, entries + trailer->count);
+    m_indexed = true;
+  }
+  else
+  {
+    rebuildIndex();
+  }
+
+  ::madvise(const_cast<uint8_t *>(m_data), m_size, MADV_SEQUENTIAL);
+}
+
+RecordingReader::~RecordingReader()
+{
+  ::munmap(const_cast<uint8_t *>(m_data), m_size);
+}
+
+void RecordingReader::rebuildIndex()
+{
+  // Walk the chunk headers; stop at the first one that is cut off or not a chunk
+  uint64_t offset = sizeof(FileHeader);
+  while (offset + sizeof(ChunkHeader) <= m_size)
+  {
+    const ChunkHeader *header = reinterpret_cast<const ChunkHeader *>(m_data + offset);
+    if (std::memcmp(header->magic, chunkMagic, sizeof(chunkMagic)) != 0 || header->size != chunkDataSize(header->count) ||
+        offset + sizeof(ChunkHeader) + header->size > m_size)
+    {
+      break;
+    }
+    IndexEntry entry = {header->timeFirst, header->timeLast, offset, header->count, 0};
+    m_index.push_back(entry);
+    offset += sizeof(ChunkHeader) + header->size;
+  }
+}
+
+uint64_t RecordingReader::rows() const
+{
+  uint64_t total = 0;
+  for (const IndexEntry &entry : m_index)
+  {
+    total += entry.count;
+  }
+  return total;
+}
+
+ChunkView RecordingReader::chunk(size_t i) const
+{
+  const IndexEntry &entry = m_index.at(i);
+  uint32_t count = entry.count;
+  const uint8_t *column = m_data + entry.offset + sizeof(ChunkHeader);
+
+  ChunkView view;
+  view.count = count;
+  view.time = reinterpret_cast<const int64_t *>(column);
+  column += padded(count * sizeof(int64_t));
+  view.code = reinterpret_cast<const int16_t *>(column);
+  column += padded(count * sizeof(int16_t));
+  view.indexDAC = reinterpret_cast<const uint16_t *>(column);
+  column += padded(count * sizeof(uint16_t));
+  view.range = reinterpret_cast<const uint16_t *>(column);
+  column += padded(count * sizeof(uint16_t));
+  view.channel = column;
+  return view;
+}
+
+size_t RecordingReader::firstChunk(int64_t timeFrom) const
+{
+  auto it = std::lower_bound(m_index.begin(), m_index.end(), timeFrom,
+                             [](const IndexEntry &entry, int64_t time) { return entry.timeLast < time; });
+  return it - m_index.begin();
+}
+
+void RecordingReader::rowsInRange(size_t i, int64_t timeFrom, int64_t timeTo, uint32_t &begin, uint32_t &end) const
+{
+  ChunkView view = chunk(i);
+  begin = std::lower_bound(view.time, view.time + view.count, timeFrom) - view.time;
+  end = std::lower_bound(view.time + begin, view.time + view.count, timeTo) - view.time;
+}
+
+void codesToCurrent(const int16_t *__restrict code, const uint16_t *__restrict range, size_t count, double rRef,
+                    float *__restrict current)
+{
+  // Same conversion as codeToCurrent() in the firmware; a plain loop the compiler vectorizes
+  const float scale = 1.0e-3f / 32768.0f / (float)rRef * 1.0e6f;
+  for (size_t i = 0; i < count; i++)
+  {
+    current[i] = (float)code[i] * (float)range[i] * scale;
+  }
+}
+
+} // namespace wozrec
@@ -0,0 +1,174 @@
+#ifndef Recording_h
+#define Recording_h
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*
+  Chunked columnar recording of reader samples.
+
+  A recording is a file header followed by chunks of up to chunkCapacity rows.
+  Each chunk has a header (row count, first and last timestamp) and stores
+  each column contiguously, so a column of a chunk is one flat array in the
+  memory-mapped file:
+
+    time     int64   us since the start of the recording
+    code     int16   raw ADC code
+    indexDAC uint16  DAC index, 0 when the mode has none
+    range    uint16  ADC full-scale range (mV), which is the PGA gain
+    channel  uint8   Differential pair, or the event tag in event mode
+
+  Closing the writer appends the time index: first and last timestamp and
+  file offset of every chunk. A recording that was not closed (reader
+  unplugged, host killed) has no index; the reader rebuilds it by walking the
+  chunk headers, losing at most the chunk that was being written.
+
+  All values are little endian, as on every host we run on.
+*/
+
+namespace wozrec
+{
+
+const char fileMagic[8] = {'W', 'O', 'Z', 'R', 'E', 'C', 0, 0};
+const char chunkMagic[4] = {'C', 'H', 'N', 'K'};
+const char indexMagic[4] = {'W', 'Z', 'I', 'X'};
+const uint32_t formatVersion = 1;
+const uint32_t defaultChunkCapacity = 65536;
+
+struct FileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t chunkCapacity;
+  double rRef; // Reference resistor in the current follower (ohm)
+  uint8_t reserved[40];
+};
+
+struct ChunkHeader
+{
+  char magic[4];
+  uint32_t count;
+  int64_t timeFirst;
+  int64_t timeLast;
+  uint64_t size; // Bytes of column data following the header
+};
+
+struct IndexEntry
+{
+  int64_t timeFirst;
+  int64_t timeLast;
+  uint64_t offset; // File offset of the chunk header
+  uint32_t count;
+  uint32_t reserved;
+};
+
+struct IndexTrailer
+{
+  uint64_t offset; // File offset of the first index entry
+  uint32_t count;
+  char magic[4];
+};
+
+static_assert(sizeof(FileHeader) == 64, "FileHeader layout");
+static_assert(sizeof(ChunkHeader) == 32, "ChunkHeader layout");
+static_assert(sizeof(IndexEntry) == 32, "IndexEntry layout");
+static_assert(sizeof(IndexTrailer) == 16, "IndexTrailer layout");
+
+struct Row
+{
+  int64_t time;
+  int16_t code;
+  uint16_t indexDAC;
+  uint16_t range;
+  uint8_t channel;
+};
+
+// Bytes of column data for a chunk of count rows, each column padded to 8 bytes
+uint64_t chunkDataSize(uint32_t count);
+
+class RecordingWriter
+{
+public:
+  RecordingWriter(const std::string &path, double rRef, uint32_t chunkCapacity = defaultChunkCapacity);
+  ~RecordingWriter();
+
+  RecordingWriter(const RecordingWriter &) = delete;
+  RecordingWriter &operator=(const RecordingWriter &) = delete;
+
+  void append(const Row &row);
+
+  // Write the buffered rows as a chunk, so they survive if the host dies
+  void flush();
+
+  // Flush and append the time index
+  void close();
+
+  uint64_t rows() const { return m_rows; }
+
+private:
+  void write(const void *data, size_t size);
+
+  std::FILE *m_file;
+  uint64_t m_offset;
+  uint64_t m_rows;
+  uint32_t m_chunkCapacity;
+  std::vector<int64_t> m_time;
+  std::vector<int16_t> m_code;
+  std::vector<uint16_t> m_indexDAC;
+  std::vector<uint16_t> m_range;
+  std::vector<uint8_t> m_channel;
+  std::vector<IndexEntry> m_index;
+};
+
+// Column arrays of one chunk, pointing into the mapped file
+struct ChunkView
+{
+  uint32_t count;
+  const int64_t *time;
+  const int16_t *code;
+  const uint16_t *indexDAC;
+  const uint16_t *range;
+  const uint8_t *channel;
+};
+
+class RecordingReader
+{
+public:
+  explicit RecordingReader(const std::string &path);
+  ~RecordingReader();
+
+  RecordingReader(const RecordingReader &) = delete;
+  RecordingReader &operator=(const RecordingReader &) = delete;
+
+  const FileHeader &header() const { return *m_header; }
+  const std::vector<IndexEntry> &index() const { return m_index; }
+  bool indexed() const { return m_indexed; }
+  uint64_t rows() const;
+  size_t chunks() const { return m_index.size(); }
+  ChunkView chunk(size_t i) const;
+
+  // Rows [begin, end) of chunk i with time in [timeFrom, timeTo), found by binary search
+  void rowsInRange(size_t i, int64_t timeFrom, int64_t timeTo, uint32_t &begin, uint32_t &end) const;
+
+  // First chunk whose last timestamp is at or after timeFrom
+  size_t firstChunk(int64_t timeFrom) const;
+
+private:
+  void rebuildIndex();
+
+  const uint8_t *m_data;
+  size_t m_size;
+  const FileHeader *m_header;
+  std::vector<IndexEntry> m_index;
+  bool m_indexed; // Index read from the file rather than rebuilt
+};
+
+// Convert codes to sensor current (uA), per row since the range may change mid recording
+void codesToCurrent(const int16_t *code, const uint16_t *range, size_t count, double rRef, float *current);
+
+} // namespace wozrec
+
+#endif
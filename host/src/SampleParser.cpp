@@ -0,0 +1,118 @@
+#include "SampleParser.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+SampleParser::SampleParser(const Settings &settings)
+    : m_settings(settings), m_timeBase(0), m_lastTime(0), m_lastReaderTime(0), m_started(false)
+{
+}
+
+bool SampleParser::parse(const std::string &line, wozrec::Row &row)
+{
+  // Records start with the time in ms; status lines start with '#' and debug prints with a letter
+  const char *cursor = line.c_str();
+  if (*cursor < '0' || *cursor > '9')
+  {
+    return false;
+  }
+
+  char *end;
+  unsigned long readerTime = std::strtoul(cursor, &end, 10);
+  if (*end != ',')
+  {
+    return false;
+  }
+  cursor = end + 1;
+
+  double value = std::strtod(cursor, &end);
+  if (end == cursor || (*end != ',' && *end != '\0'))
+  {
+    return false;
+  }
+  if (m_settings.format == 1)
+  {
+    row.code = (int16_t)value;
+  }
+  else
+  {
+    // Inverse of codeToCurrent() in the firmware; the 3 printed decimals resolve single codes from 1024 mV up
+    double multiplier = m_settings.range * 1.0e-3 / 32768.0;
+    row.code = (int16_t)std::lround(value * 1.0e-6 * m_settings.rRef / multiplier);
+  }
+  row.range = m_settings.range;
+  row.indexDAC = 0;
+  row.channel = 0;
+
+  if (*end == ',')
+  {
+    cursor = end + 1;
+    if (m_settings.setting == 'e')
+    {
+      row.channel = (uint8_t)*cursor;
+    }
+    else if (m_settings.setting == 'c' && m_settings.input == 1)
+    {
+      row.channel = (uint8_t)std::strtoul(cursor, NULL, 10);
+    }
+    else if (m_settings.setting != 'c')
+    {
+      row.indexDAC = (uint16_t)std::strtoul(cursor, NULL, 10);
+    }
+  }
+
+  // A reader time going back means the reader restarted the experiment
+  if (m_started && readerTime < m_lastReaderTime)
+  {
+    m_timeBase = m_lastTime;
+  }
+  m_started = true;
+  m_lastReaderTime = readerTime;
+  row.time = m_timeBase + (int64_t)readerTime * 1000;
+  m_lastTime = row.time;
+  return true;
+}
+
+bool SampleParser::settingsFromSetup(const std::string &message, Settings &settings)
+{
+  if (message.size() < 3 || message[0] != '<' || message[message.size() - 1] != '>')
+  {
+    return false;
+  }
+
+  // Fields as the firmware reads them: missing or empty ones count as 0
+  std::vector<std::string> fields;
+  std::string body = message.substr(1, message.size() - 2);
+  size_t start = 0;
+  while (true)
+  {
+    size_t delim = body.find(';', start);
+    fields.push_back(body.substr(start, delim - start));
+    if (delim == std::string::npos)
+    {
+      break;
+    }
+    start = delim + 1;
+  }
+  fields.resize(19);
+
+  if (fields[0].size() != 1 || std::strchr("csepw", fields[0][0]) == NULL)
+  {
+    return false;
+  }
+  settings.setting = fields[0][0];
+  settings.range = std::atoi(fields[11].c_str());
+  settings.format = std::atoi(fields[13].c_str());
+  settings.input = std::atoi(fields[16].c_str());
+
+  // Ranges the ADC has no gain for fall back to 1024 mV, as in setupADC()
+  static const int ranges[] = {6144, 4096, 2048, 1024, 512, 256};
+  if (std::find(ranges, ranges + 6, settings.range) == ranges + 6)
+  {
+    settings.range = 1024;
+  }
+  return true;
+}
@@ -0,0 +1,58 @@
+#ifndef SampleParser_h
+#define SampleParser_h
+
+#include <string>
+
+#include "Recording.h"
+
+/*
+  Turns reader data lines into recording rows. The meaning of a record's
+  columns depends on the mode it was configured with, so the parser is given
+  the same settings as the setup message:
+
+    c, input 0   time,value
+    c, input 1   time,value,channel
+    s            time,value,dac_index,lag
+    e            time,value,tag        (the tag character is stored as channel)
+    p, w         time,value,dac_index
+
+  Trailing window statistics are ignored. Status lines (#...) and debug prints
+  are not samples.
+
+  The reader restarts its time at 0 whenever it accepts a setup message. Times
+  are made monotonic by continuing from the last sample when that happens, so
+  the recording can still be searched by time.
+*/
+class SampleParser
+{
+public:
+  struct Settings
+  {
+    char setting = 'c';
+    int input = 0;
+    int format = 0;     // 0 current (uA), 1 raw ADC codes, as in the setup message
+    int range = 1024;   // ADC full-scale range (mV)
+    double rRef = 22e3; // Reference resistor in the current follower (ohm)
+  };
+
+  explicit SampleParser(const Settings &settings);
+
+  // Settings of a setup message "<setting;median;...>" as the reader applies them, rRef is left as it is.
+  // Returns false if the message is not a setup message
+  static bool settingsFromSetup(const std::string &message, Settings &settings);
+
+  // Parse a line without its line ending. Returns false for lines that are not samples
+  bool parse(const std::string &line, wozrec::Row &row);
+
+  // Time of a sample in reader time (ms since the reader started the experiment), before it is made monotonic
+  unsigned long lastReaderTime() const { return m_lastReaderTime; }
+
+private:
+  Settings m_settings;
+  int64_t m_timeBase;      // us added to reader time, moved on every reader restart
+  int64_t m_lastTime;      // Last recording time (us)
+  unsigned long m_lastReaderTime;
+  bool m_started;
+};
+
+#endif
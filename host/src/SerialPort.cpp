@@ -0,0 +1,160 @@
+#include "SerialPort.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+static speed_t baudConstant(int baud)
+{
+  switch (baud)
+  {
+  case (9600):
+    return B9600;
+  case (57600):
+    return B57600;
+  case (115200):
+    return B115200;
+  case (230400):
+    return B230400;
+#ifdef B500000
+  case (500000):
+    return B500000;
+#endif
+#ifdef B1000000
+  case (1000000):
+    return B1000000;
+#endif
+  default:
+    throw std::invalid_argument("unsupported baud rate " + std::to_string(baud));
+  }
+}
+
+SerialPort::SerialPort(const std::string &path, int baud) : m_terminal(false), m_owned(true), m_scanned(0)
+{
+  if (path == "-")
+  {
+    m_fd = STDIN_FILENO;
+    m_owned = false;
+    return;
+  }
+
+  m_fd = ::open(path.c_str(), O_RDWR | O_NOCTTY);
+  if (m_fd < 0)
+  {
+    m_fd = ::open(path.c_str(), O_RDONLY);
+  }
+  if (m_fd < 0)
+  {
+    throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+  }
+
+  struct termios tty;
+  if (::tcgetattr(m_fd, &tty) != 0)
+  {
+    return; // Not a terminal, read as a plain file
+  }
+  m_terminal = true;
+  ::cfmakeraw(&tty);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cc[VMIN] = 1;
+  tty.c_cc[VTIME] = 0;
+  speed_t speed = baudConstant(baud);
+  ::cfsetispeed(&tty, speed);
+  ::cfsetospeed(&tty, speed);
+  if (::tcsetattr(m_fd, TCSANOW, &tty) != 0)
+  {
+    ::close(m_fd);
+    throw std::runtime_error("cannot configure " + path + ": " + std::strerror(errno));
+  }
+  ::tcflush(m_fd, TCIOFLUSH);
+}
+
+SerialPort::~SerialPort()
+{
+  if (m_owned)
+  {
+    ::close(m_fd);
+  }
+}
+
+bool SerialPort::readLine(std::string &line, int timeout)
+{
+  while (true)
+  {
+    size_t end = m_buffer.find('\n', m_scanned);
+    if (end != std::string::npos)
+    {
+      size_t length = end;
+      if (length > 0 && m_buffer[length - 1] == '\r')
+      {
+        length--;
+      }
+      line.assign(m_buffer, 0, length);
+      m_buffer.erase(0, end + 1);
+      m_scanned = 0;
+      return true;
+    }
+    m_scanned = m_buffer.size();
+
+    if (timeout >= 0)
+    {
+      struct pollfd request = {m_fd, POLLIN, 0};
+      int ready = ::poll(&request, 1, timeout);
+      if (ready == 0)
+      {
+        return false;
+      }
+      if (ready < 0 && errno != EINTR)
+      {
+        throw std::runtime_error(std::string("poll failed: ") + std::strerror(errno));
+      }
+    }
+
+    char data[4096];
+    ssize_t count = ::read(m_fd, data, sizeof(data));
+    if (count < 0 && (errno == EINTR || errno == EAGAIN))
+    {
+      continue;
+    }
+    if (count <= 0)
+    {
+      // End of input (or a pty whose other side closed): hand out a last unterminated line
+      if (m_buffer.empty())
+      {
+        return false;
+      }
+      line.swap(m_buffer);
+      m_buffer.clear();
+      m_scanned = 0;
+      return true;
+    }
+    m_buffer.append(data, count);
+  }
+}
+
+void SerialPort::write(const std::string &data)
+{
+  size_t written = 0;
+  while (written < data.size())
+  {
+    ssize_t count = ::write(m_fd, data.data() + written, data.size() - written);
+    if (count < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+      {
+        continue;
+      }
+      throw std::runtime_error(std::string("write failed: ") + std::strerror(errno));
+    }
+    written += count;
+  }
+  if (m_terminal)
+  {
+    ::tcdrain(m_fd);
+  }
+}
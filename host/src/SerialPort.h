@@ -0,0 +1,38 @@
+#ifndef SerialPort_h
+#define SerialPort_h
+
+#include <string>
+
+/*
+  Line oriented access to a reader. The path is normally a serial device,
+  which is switched to raw mode at the reader baud rate; any other file (a
+  capture, a pipe, "-" for stdin) is read as is.
+*/
+class SerialPort
+{
+public:
+  static const int defaultBaud = 500000; // monitor_speed in platformio.ini
+
+  explicit SerialPort(const std::string &path, int baud = defaultBaud);
+  ~SerialPort();
+
+  SerialPort(const SerialPort &) = delete;
+  SerialPort &operator=(const SerialPort &) = delete;
+
+  // Read one line without its line ending. Returns false on timeout (ms, -1 waits forever) or end of input
+  bool readLine(std::string &line, int timeout = -1);
+
+  void write(const std::string &data);
+
+  bool terminal() const { return m_terminal; }
+  int fd() const { return m_fd; }
+
+private:
+  int m_fd;
+  bool m_terminal;
+  bool m_owned; // Close the descriptor on destruction (not stdin)
+  std::string m_buffer;
+  size_t m_scanned; // Bytes of m_buffer already searched for a line ending
+};
+
+#endif
@@ -0,0 +1,300 @@
+/*
+  wozrec: record reader streams to chunked columnar files and read them back.
+
+    wozrec record [options] <port> <recording>   Record until the stream ends or Ctrl-C
+    wozrec info <recording>                      Rows, chunks and time span
+    wozrec export [options] <recording>          CSV on stdout
+*/
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Handshake.h"
+#include "Recording.h"
+#include "SampleParser.h"
+#include "SerialPort.h"
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+  stopRequested = 1;
+}
+
+static void usage()
+{
+  std::fprintf(stderr,
+               "usage: wozrec record [--setup message] [--setting c|s|e|p|w] [--input n] [--format n] [--range mV]\n"
+               "                     [--rref ohm] [--chunk rows] [--baud n] <port|file|-> <recording>\n"
+               "       wozrec info <recording>\n"
+               "       wozrec export [--from ms] [--to ms] [--raw] <recording>\n");
+}
+
+// Options are "--name value" or bare flags; everything else is positional
+struct Arguments
+{
+  std::vector<std::string> positional;
+  std::vector<std::pair<std::string, std::string>> options;
+
+  Arguments(int argc, char **argv, const std::vector<std::string> &flags)
+  {
+    for (int i = 0; i < argc; i++)
+    {
+      std::string arg = argv[i];
+      if (arg.size() > 2 && arg.compare(0, 2, "--") == 0)
+      {
+        std::string name = arg.substr(2);
+        bool flag = false;
+        for (const std::string &f : flags)
+        {
+          flag = flag || f == name;
+        }
+        if (flag)
+        {
+          options.emplace_back(name, "1");
+        }
+        else if (i + 1 < argc)
+        {
+          options.emplace_back(name, argv[++i]);
+        }
+        else
+        {
+          throw std::invalid_argument("missing value for " + arg);
+        }
+      }
+      else
+      {
+        positional.push_back(arg);
+      }
+    }
+  }
+
+  const char *get(const std::string &name, const char *fallback) const
+  {
+    const char *value = fallback;
+    for (const auto &option : options)
+    {
+      if (option.first == name)
+      {
+        value = option.second.c_str();
+      }
+    }
+    return value;
+  }
+};
+
+static int record(const Arguments &args)
+{
+  if (args.positional.size() != 2)
+  {
+    usage();
+    return 2;
+  }
+
+  // The setup message decides what the columns mean; the flags describe streams captured without one
+  SampleParser::Settings settings;
+  const char *setup = args.get("setup", NULL);
+  if (setup)
+  {
+    if (args.get("setting", NULL) || args.get("input", NULL) || args.get("format", NULL) || args.get("range", NULL))
+    {
+      std::fprintf(stderr, "wozrec: --setting, --input, --format and --range are taken from --setup\n");
+      return 2;
+    }
+    if (!SampleParser::settingsFromSetup(setup, settings))
+    {
+      std::fprintf(stderr, "wozrec: not a setup message: %s\n", setup);
+      return 2;
+    }
+  }
+  else
+  {
+    settings.setting = args.get("setting", "c")[0];
+    settings.input = std::atoi(args.get("input", "0"));
+    settings.format = std::atoi(args.get("format", "0"));
+    settings.range = std::atoi(args.get("range", "1024"));
+  }
+  settings.rRef = std::atof(args.get("rref", "22000"));
+  if (std::strchr("csepw", settings.setting) == NULL || settings.range <= 0 || settings.rRef <= 0)
+  {
+    usage();
+    return 2;
+  }
+
+  SerialPort port(args.positional[0], std::atoi(args.get("baud", "500000")));
+  wozrec::RecordingWriter writer(args.positional[1], settings.rRef, std::atoi(args.get("chunk", "65536")));
+  SampleParser parser(settings);
+
+  // Start as soon as the reader has applied the setup message, records of the old configuration are skipped
+  if (setup && port.terminal())
+  {
+    Capabilities capabilities;
+    if (!waitHello(port, capabilities))
+    {
+      std::fprintf(stderr, "wozrec: no hello from reader, sending setup anyway\n");
+    }
+    sendSetup(port, setup);
+  }
+
+  std::signal(SIGINT, onSignal);
+  std::signal(SIGTERM, onSignal);
+
+  std::string line;
+  wozrec::Row row;
+  unsigned long skipped = 0;
+  while (!stopRequested)
+  {
+    // Poll with a timeout so Ctrl-C is noticed on a quiet port
+    if (!port.readLine(line, port.terminal() ? 200 : -1))
+    {
+      if (port.terminal())
+      {
+        continue;
+      }
+      break;
+    }
+    if (parser.parse(line, row))
+    {
+      writer.append(row);
+    }
+    else if (!line.empty() && line[0] == '#')
+    {
+      std::fprintf(stderr, "%s\n", line.c_str());
+    }
+    else
+    {
+      skipped++;
+    }
+  }
+
+  writer.close();
+  std::fprintf(stderr, "%llu rows recorded, %lu other lines skipped\n", (unsigned long long)writer.rows(), skipped);
+  return 0;
+}
+
+static int info(const Arguments &args)
+{
+  if (args.positional.size() != 1)
+  {
+    usage();
+    return 2;
+  }
+
+  wozrec::RecordingReader reader(args.positional[0]);
+  std::printf("rows: %llu\n", (unsigned long long)reader.rows());
+  std::printf("chunks: %zu (capacity %u rows)\n", reader.chunks(), reader.header().chunkCapacity);
+  std::printf("index: %s\n", reader.indexed() ? "stored" : "rebuilt, recording was not closed");
+  std::printf("rref: %g ohm\n", reader.header().rRef);
+  if (reader.chunks() > 0)
+  {
+    double first = reader.index().front().timeFirst * 1e-3;
+    double last = reader.index().back().timeLast * 1e-3;
+    std::printf("time: %.3f to %.3f ms (%.3f s)\n", first, last, (last - first) * 1e-3);
+  }
+  return 0;
+}
+
+static int exportCsv(const Arguments &args)
+{
+  if (args.positional.size() != 1)
+  {
+    usage();
+    return 2;
+  }
+
+  const char *from = args.get("from", NULL);
+  const char *to = args.get("to", NULL);
+  int64_t timeFrom = from ? (int64_t)(std::atof(from) * 1000) : INT64_MIN;
+  int64_t timeTo = to ? (int64_t)(std::atof(to) * 1000) : INT64_MAX;
+  bool raw = std::atoi(args.get("raw", "0")) != 0;
+
+  wozrec::RecordingReader reader(args.positional[0]);
+  double rRef = reader.header().rRef;
+
+  std::string out;
+  out.reserve(1 << 20);
+  out += raw ? "time,code,dac_index,range,channel\n" : "time,current,dac_index,range,channel\n";
+
+  // Skip to the first chunk in range through the index, convert a chunk at a time
+  std::vector<float> current;
+  char field[96];
+  for (size_t i = reader.firstChunk(timeFrom); i < reader.chunks(); i++)
+  {
+    if (reader.index()[i].timeFirst >= timeTo)
+    {
+      break;
+    }
+    wozrec::ChunkView view = reader.chunk(i);
+    uint32_t begin;
+    uint32_t end;
+    reader.rowsInRange(i, timeFrom, timeTo, begin, end);
+    if (!raw)
+    {
+      current.resize(end - begin);
+      wozrec::codesToCurrent(view.code + begin, view.range + begin, end - begin, rRef, current.data());
+    }
+
+    for (uint32_t row = begin; row < end; row++)
+    {
+      int length;
+      if (raw)
+      {
+        length = std::snprintf(field, sizeof(field), "%.3f,%d,%u,%u,%u\n", view.time[row] * 1e-3, view.code[row],
+                               view.indexDAC[row], view.range[row], view.channel[row]);
+      }
+      else
+      {
+        length = std::snprintf(field, sizeof(field), "%.3f,%.6f,%u,%u,%u\n", view.time[row] * 1e-3,
+                               current[row - begin], view.indexDAC[row], view.range[row], view.channel[row]);
+      }
+      out.append(field, length);
+    }
+
+    if (out.size() > (1 << 20) - 4096)
+    {
+      std::fwrite(out.data(), 1, out.size(), stdout);
+      out.clear();
+    }
+  }
+  std::fwrite(out.data(), 1, out.size(), stdout);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+
+  std::string command = argv[1];
+  try
+  {
+    if (command == "record")
+    {
+      return record(Arguments(argc - 2, argv + 2, {}));
+    }
+    if (command == "info")
+    {
+      return info(Arguments(argc - 2, argv + 2, {}));
+    }
+    if (command == "export")
+    {
+      return exportCsv(Arguments(argc - 2, argv + 2, {"raw"}));
+    }
+  }
+  catch (const std::exception &error)
+  {
+    std::fprintf(stderr, "wozrec: %s\n", error.what());
+    return 1;
+  }
+
+  usage();
+  return 2;
+}
@@ -0,0 +1,275 @@
+/*
+  wozsim: simulated readers on pseudo terminals, to try the host tools without
+  hardware.
+
+    wozsim [--rate SPS] [--drift ppm] [--poll us] [--seed n] <boards>
+
+  Prints the terminal path of every board, then serves them until killed. Like
+  an Uno, a board resets when its terminal is opened and sends its hello once
+  the bootloader time has passed. Each board clock runs fast or slow by up to
+  the given drift. Boards answer hello requests, setup messages and clock sync
+  pings like the firmware and send constant mode records (time,current) whose
+  current is the same square wave for every board, stepping every second of
+  real time, so a correctly merged stream shows the steps at the same time for
+  all boards. Serial latency is simulated with random delays in both
+  directions. A message waits in the board's receive buffer until the next
+  serial poll, up to the given poll interval (300 us, a pass of the conversion
+  wait loop; 86000 models polling once per block of 11 conversions at
+  128 SPS). A setup message restarts the experiment time.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+static int64_t realMicros()
+{
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct Output
+{
+  int64_t due; // Real time the line reaches the host (us)
+  std::string line;
+};
+
+const int64_t bootloaderMicros = 500000; // Reset to sketch start on an Uno
+const char hello[] = "#hello,version=1,modes=c,formats=0,queue=8,segment=48,tx=64,baud=500000,sync=1";
+
+struct Board
+{
+  int master;
+  bool connected; // A host has the terminal open
+  double boot;    // Real time of the board's reset (us)
+  double rate;    // Board us per real us
+  double start; // Board time the experiment started (us)
+  int64_t nextSample;
+  std::string input;
+  std::deque<Output> output;
+
+  // Board micros() at a real time
+  double clock(int64_t real) const { return (real - boot) * rate; }
+};
+
+static void send(Board &board, int64_t due, const std::string &line)
+{
+  // Lines leave in order, a line never overtakes the one before it
+  if (!board.output.empty() && board.output.back().due > due)
+  {
+    due = board.output.back().due;
+  }
+  Output output = {due, line + "\r\n"};
+  board.output.push_back(output);
+}
+
+int main(int argc, char **argv)
+{
+  int sampleRate = 100;
+  double maxDrift = 100;
+  int64_t pollMicros = 300;
+  unsigned seed = std::random_device()();
+  int count = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--rate" && i + 1 < argc)
+    {
+      sampleRate = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (arg == "--drift" && i + 1 < argc)
+    {
+      maxDrift = std::atof(argv[++i]);
+    }
+    else if (arg == "--poll" && i + 1 < argc)
+    {
+      pollMicros = std::max(1L, std::atol(argv[++i]));
+    }
+    else if (arg == "--seed" && i + 1 < argc)
+    {
+      seed = std::strtoul(argv[++i], NULL, 10);
+    }
+    else
+    {
+      count = std::atoi(argv[i]);
+    }
+  }
+  if (count <= 0)
+  {
+    std::fprintf(stderr, "usage: wozsim [--rate SPS] [--drift ppm] [--poll us] [--seed n] <boards>\n");
+    return 2;
+  }
+
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<Board> boards(count);
+  for (Board &board : boards)
+  {
+    struct termios raw;
+    std::memset(&raw, 0, sizeof(raw));
+    ::cfmakeraw(&raw);
+    char name[128];
+    int slave;
+    if (::openpty(&board.master, &slave, name, &raw, NULL) != 0)
+    {
+      std::perror("openpty");
+      return 1;
+    }
+    // With no slave open the master reports a hangup, which is how a host opening the terminal is seen
+    ::close(slave);
+    ::fcntl(board.master, F_SETFL, ::fcntl(board.master, F_GETFL) | O_NONBLOCK);
+    board.connected = false;
+    board.rate = 1.0 + (2 * uniform(random) - 1) * maxDrift * 1e-6;
+    std::printf("%s\n", name);
+    std::fprintf(stderr, "%s: drift %+.1f ppm\n", name, (board.rate - 1) * 1e6);
+  }
+  std::fflush(stdout);
+
+  int64_t period = 1000000 / sampleRate;
+  std::vector<struct pollfd> requests(count);
+  while (true)
+  {
+    // Sleep until the next sample or delivery is due, or a host writes
+    int64_t now = realMicros();
+    int64_t wake = now + 100000;
+    for (Board &board : boards)
+    {
+      if (!board.connected)
+      {
+        continue;
+      }
+      wake = std::min(wake, board.nextSample);
+      if (!board.output.empty())
+      {
+        wake = std::min(wake, board.output.front().due);
+      }
+    }
+    // A hung up master polls ready at once, so disconnected boards are checked on every wake instead
+    for (int i = 0; i < count; i++)
+    {
+      requests[i].fd = boards[i].connected ? boards[i].master : -1;
+      requests[i].events = POLLIN;
+      requests[i].revents = 0;
+    }
+    ::poll(requests.data(), count, wake > now ? (int)((wake - now + 999) / 1000) : 0);
+    now = realMicros();
+
+    for (int i = 0; i < count; i++)
+    {
+      Board &board = boards[i];
+      struct pollfd state = {board.master, POLLIN, 0};
+      ::poll(&state, 1, 0);
+      bool hangup = state.revents & POLLHUP;
+      if (board.connected && hangup)
+      {
+        board.connected = false;
+        board.output.clear();
+        continue;
+      }
+      if (!board.connected)
+      {
+        if (hangup)
+        {
+          continue;
+        }
+        // Terminal opened: reset, then run the stored configuration after the bootloader
+        board.connected = true;
+        board.boot = now;
+        board.start = board.clock(now + bootloaderMicros);
+        board.nextSample = now + bootloaderMicros;
+        board.input.clear();
+        send(board, now + bootloaderMicros, hello);
+      }
+
+      if (requests[i].revents & POLLIN)
+      {
+        char data[256];
+        ssize_t length = ::read(board.master, data, sizeof(data));
+        for (ssize_t k = 0; k < length; k++)
+        {
+          char c = data[k];
+          if (c == '<')
+          {
+            board.input.clear();
+          }
+          board.input += c;
+          if (c != '>' || board.input[0] != '<')
+          {
+            continue;
+          }
+
+          // Ping arrives after the host to reader latency, is read at the next serial poll and answered at once
+          int64_t arrived = now + 200 + (int64_t)(uniform(random) * 2000);
+          int64_t received = arrived + (int64_t)(uniform(random) * pollMicros);
+          int64_t sent = received + 50 + (int64_t)(uniform(random) * 500);
+          if (now < board.boot + bootloaderMicros)
+          {
+            // Still in the bootloader, the message is lost
+          }
+          else if (board.input.compare(0, 3, "<y;") == 0)
+          {
+            long sequence = std::atol(board.input.c_str() + 3);
+            char line[96];
+            std::snprintf(line, sizeof(line), "#sync,%ld,%lu,%lu,%lu", sequence,
+                          (unsigned long)((uint64_t)board.clock(received) & 0xFFFFFFFF),
+                          (unsigned long)((board.clock(sent) - board.start) / 1000),
+                          (unsigned long)((uint64_t)board.clock(sent) & 0xFFFFFFFF));
+            send(board, sent + 200 + (int64_t)(uniform(random) * 2000), line);
+          }
+          else if (board.input == "<h>")
+          {
+            send(board, sent + 200 + (int64_t)(uniform(random) * 2000), hello);
+          }
+          else if (board.input.compare(0, 3, "<c;") == 0 || board.input == "<c>")
+          {
+            board.start = board.clock(received);
+            send(board, sent + 200 + (int64_t)(uniform(random) * 2000), "#ack,c");
+          }
+          else
+          {
+            send(board, sent + 200 + (int64_t)(uniform(random) * 2000), "#nak");
+          }
+          board.input.clear();
+        }
+      }
+
+      while (board.nextSample <= now)
+      {
+        // Square wave of real time, sampled on the board clock
+        int64_t real = board.nextSample;
+        double current = (real / 1000000) % 2 ? 1.0 : 0.5;
+        char line[64];
+        double elapsed = std::max(0.0, board.clock(real) - board.start);
+        std::snprintf(line, sizeof(line), "%lu,%.3f", (unsigned long)(elapsed / 1000), current);
+        send(board, real + 200 + (int64_t)(uniform(random) * 2000), line);
+        board.nextSample += period;
+      }
+
+      while (!board.output.empty() && board.output.front().due <= now)
+      {
+        const std::string &line = board.output.front().line;
+        if (::write(board.master, line.data(), line.size()) < 0)
+        {
+          // Nobody reading and the terminal buffer is full: drop, as the firmware would
+        }
+        board.output.pop_front();
+      }
+    }
+  }
+}
@@ -0,0 +1,345 @@
+/*
+  wozsync: acquire from several readers at once and merge their records onto
+  the host clock.
+
+    wozsync [options] <port> <port> ...
+
+  Every reader is pinged with <y;seq> throughout the run. At the end each
+  reader clock is fitted (ClockSync) and the records of all readers are written
+  as one CSV, ordered by host time:
+
+    time,board,<record columns after the time>
+
+  time is in ms since wozsync started, board is the position of the port on
+  the command line.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+
+#include "ClockSync.h"
+#include "Handshake.h"
+#include "SerialPort.h"
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+static void onSignal(int)
+{
+  stopRequested = 1;
+}
+
+static void usage()
+{
+  std::fprintf(stderr, "usage: wozsync [--setup message] [--interval ms] [--duration s] [--group n] [--out file]\n"
+                       "               <port> <port> ...\n");
+}
+
+static int64_t hostMicros()
+{
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Records between two reader restarts share the reader time their experiment time counts from
+struct Segment
+{
+  double anchorSum; // Sum of reader us at experiment time 0, one per sync answer
+  unsigned long anchors;
+  uint32_t lastTime; // Latest record time (ms)
+};
+
+struct Record
+{
+  uint32_t time; // Experiment time (ms)
+  size_t segment;
+  std::string columns; // Record after the time, including the leading ','
+};
+
+struct Board
+{
+  std::unique_ptr<SerialPort> port;
+  ClockSync sync;
+  long sequence;
+  std::vector<std::pair<long, int64_t>> pending; // Pings sent and not answered: sequence and host time
+  std::vector<Segment> segments;
+  std::vector<Record> records;
+  Segment next; // Anchors answered after a restart, before the first record of the new experiment
+
+  explicit Board(size_t group) : sync(group), sequence(0), next() {}
+
+  // Records leave the reader in order, so a record time going back means the experiment restarted
+  size_t segmentOf(uint32_t time)
+  {
+    if (segments.empty() || time < segments.back().lastTime)
+    {
+      segments.push_back(next);
+      next = Segment();
+    }
+    segments.back().lastTime = time;
+    return segments.size() - 1;
+  }
+
+  // Answers can overtake queued records, which are older; only an answer from before the last record means a restart
+  void anchor(uint32_t elapsed, double readerStart)
+  {
+    Segment &segment = (segments.empty() || elapsed < segments.back().lastTime) ? next : segments.back();
+    segment.anchorSum += readerStart;
+    segment.anchors++;
+  }
+};
+
+static void receive(Board &board, const std::string &line, int64_t now)
+{
+  ClockSync::Reply reply;
+  if (ClockSync::parseReply(line, reply))
+  {
+    for (size_t i = 0; i < board.pending.size(); i++)
+    {
+      if (board.pending[i].first == reply.sequence)
+      {
+        ClockSync::Exchange exchange;
+        exchange.hostSent = board.pending[i].second;
+        exchange.readerReceived = board.sync.unwrap(reply.received);
+        exchange.readerSent = board.sync.unwrap(reply.sent);
+        exchange.hostReceived = now;
+        board.sync.add(exchange);
+        board.pending.erase(board.pending.begin() + i);
+
+        board.anchor(reply.elapsed, exchange.readerSent - reply.elapsed * 1000.0);
+        break;
+      }
+    }
+    return;
+  }
+
+  // Records start with the experiment time; status lines and debug prints are dropped
+  if (line.empty() || line[0] < '0' || line[0] > '9')
+  {
+    return;
+  }
+  char *end;
+  unsigned long time = std::strtoul(line.c_str(), &end, 10);
+  if (*end != ',')
+  {
+    return;
+  }
+  Record record;
+  record.time = time;
+  record.segment = board.segmentOf(time);
+  record.columns.assign(end);
+  board.records.push_back(record);
+}
+
+int main(int argc, char **argv)
+{
+  hostMicros(); // Host time counts from here
+
+  const char *setup = NULL;
+  int interval = 100;
+  double duration = 0;
+  int group = 8;
+  const char *out = NULL;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") == 0 && i + 1 >= argc)
+    {
+      usage();
+      return 2;
+    }
+    if (arg == "--setup")
+    {
+      setup = argv[++i];
+    }
+    else if (arg == "--interval")
+    {
+      interval = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (arg == "--duration")
+    {
+      duration = std::atof(argv[++i]);
+    }
+    else if (arg == "--group")
+    {
+      group = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (arg == "--out")
+    {
+      out = argv[++i];
+    }
+    else
+    {
+      paths.push_back(arg);
+    }
+  }
+  if (paths.empty())
+  {
+    usage();
+    return 2;
+  }
+
+  try
+  {
+    std::vector<Board> boards;
+    for (const std::string &path : paths)
+    {
+      boards.emplace_back(group);
+      boards.back().port.reset(new SerialPort(path));
+    }
+
+    // Opening a port resets its reader, so all are opened before waiting for any of them
+    for (size_t i = 0; i < boards.size(); i++)
+    {
+      Capabilities capabilities;
+      if (!waitHello(*boards[i].port, capabilities))
+      {
+        std::fprintf(stderr, "%s: no hello from reader\n", paths[i].c_str());
+      }
+      else if (capabilities.get("sync") != "1")
+      {
+        throw std::runtime_error(paths[i] + ": reader firmware has no clock sync");
+      }
+      if (setup)
+      {
+        sendSetup(*boards[i].port, setup);
+      }
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+
+    // Ping the boards in turn, spread over the interval, and read whatever arrives in between
+    int64_t step = interval * 1000LL / boards.size();
+    int64_t nextPing = hostMicros();
+    size_t nextBoard = 0;
+    int64_t stop = duration > 0 ? hostMicros() + (int64_t)(duration * 1e6) : INT64_MAX;
+    std::vector<struct pollfd> requests(boards.size());
+    std::string line;
+    size_t open = boards.size();
+    while (!stopRequested && open > 0 && hostMicros() < stop)
+    {
+      int64_t now = hostMicros();
+      if (now >= nextPing)
+      {
+        Board &board = boards[nextBoard];
+        if (board.port)
+        {
+          board.sequence++;
+          board.pending.emplace_back(board.sequence, hostMicros());
+          board.port->write("<y;" + std::to_string(board.sequence) + ">");
+          // Answers that never came (reader busy restarting) are not waited for forever
+          if (board.pending.size() > 16)
+          {
+            board.pending.erase(board.pending.begin());
+          }
+        }
+        nextBoard = (nextBoard + 1) % boards.size();
+        nextPing += step;
+        continue;
+      }
+
+      for (size_t i = 0; i < boards.size(); i++)
+      {
+        requests[i].fd = boards[i].port ? boards[i].port->fd() : -1;
+        requests[i].events = POLLIN;
+        requests[i].revents = 0;
+      }
+      int timeout = (int)((nextPing - now + 999) / 1000);
+      if (::poll(requests.data(), requests.size(), timeout) <= 0)
+      {
+        continue;
+      }
+      now = hostMicros();
+      for (size_t i = 0; i < boards.size(); i++)
+      {
+        if (requests[i].revents == 0)
+        {
+          continue;
+        }
+        if (requests[i].revents & (POLLERR | POLLHUP | POLLNVAL) && !(requests[i].revents & POLLIN))
+        {
+          std::fprintf(stderr, "board %zu: port closed\n", i);
+          boards[i].port.reset();
+          open--;
+          continue;
+        }
+        while (boards[i].port->readLine(line, 0))
+        {
+          receive(boards[i], line, now);
+        }
+      }
+    }
+
+    // Fit every reader clock and place its records on the host clock
+    struct Merged
+    {
+      double time;
+      size_t board;
+      const std::string *columns;
+    };
+    std::vector<Merged> merged;
+    for (size_t i = 0; i < boards.size(); i++)
+    {
+      Board &board = boards[i];
+      if (!board.sync.fit())
+      {
+        std::fprintf(stderr, "board %zu: no sync answers, %zu records dropped\n", i, board.records.size());
+        continue;
+      }
+      std::fprintf(stderr, "board %zu: %zu exchanges, %zu used, min round trip %lld us, drift %+.1f ppm, residual %.1f us\n",
+                   i, board.sync.exchanges(), board.sync.used(), (long long)board.sync.minRoundTrip(),
+                   board.sync.drift(), board.sync.residual());
+
+      size_t unanchored = 0;
+      for (const Record &record : board.records)
+      {
+        const Segment &segment = board.segments[record.segment];
+        if (segment.anchors == 0)
+        {
+          unanchored++;
+          continue;
+        }
+        double reader = segment.anchorSum / segment.anchors + record.time * 1000.0;
+        Merged entry = {board.sync.toHost(reader) * 1e-3, i, &record.columns};
+        merged.push_back(entry);
+      }
+      if (unanchored > 0)
+      {
+        std::fprintf(stderr, "board %zu: %zu records after a restart without a sync answer dropped\n", i, unanchored);
+      }
+    }
+    std::stable_sort(merged.begin(), merged.end(), [](const Merged &a, const Merged &b) { return a.time < b.time; });
+
+    std::FILE *file = out ? std::fopen(out, "w") : stdout;
+    if (!file)
+    {
+      throw std::runtime_error(std::string("cannot create ") + out);
+    }
+    std::fprintf(file, "time,board,record\n");
+    for (const Merged &entry : merged)
+    {
+      std::fprintf(file, "%.3f,%zu%s\n", entry.time, entry.board, entry.columns->c_str());
+    }
+    if (out)
+    {
+      std::fclose(file);
+    }
+  }
+  catch (const std::exception &error)
+  {
+    std::fprintf(stderr, "wozsync: %s\n", error.what());
+    return 1;
+  }
+  return 0;
+}
@@ -37,6 +37,9 @@
 
 #include "Adafruit_ADS1015.h"
 
+using ads1x15::readRegister;
+using ads1x15::writeRegister;
+
 /**************************************************************************/
 /*!
     @brief  Abstract away platform differences in Arduino wire library
@@ -71,14 +74,15 @@ static void i2cwrite(uint8_t x)
 
 /**************************************************************************/
 /*!
-    @brief  Writes 16-bits to the specified destination register
+    @brief  Writes 16-bits to the specified destination register. Shared
+            with the ADS1x15 template, so there is one copy of the I2C code
 
     @param i2cAddress I2C address of device
     @param reg register address to write to
     @param value value to write to register
 */
 /**************************************************************************/
-static void writeRegister(uint8_t i2cAddress, uint8_t reg, uint16_t value)
+void ads1x15::writeRegister(uint8_t i2cAddress, uint8_t reg, uint16_t value)
 {
   Wire.beginTransmission(i2cAddress);
   i2cwrite((uint8_t)reg);
@@ -89,7 +93,8 @@ static void writeRegister(uint8_t i2cAddress, uint8_t reg, uint16_t value)
 
 /**************************************************************************/
 /*!
-    @brief  Read 16-bits from the specified destination register
+    @brief  Read 16-bits from the specified destination register. Shared
+            with the ADS1x15 template
 
     @param i2cAddress I2C address of device
     @param reg register address to read from
@@ -97,7 +102,7 @@ static void writeRegister(uint8_t i2cAddress, uint8_t reg, uint16_t value)
     @return 16 bit register value read
 */
 /**************************************************************************/
-static uint16_t readRegister(uint8_t i2cAddress, uint8_t reg)
+uint16_t ads1x15::readRegister(uint8_t i2cAddress, uint8_t reg)
 {
   Wire.beginTransmission(i2cAddress);
   i2cwrite(reg);
@@ -119,6 +124,7 @@ Adafruit_ADS1015::Adafruit_ADS1015(uint8_t i2cAddress)
   m_conversionDelay = ADS1015_CONVERSIONDELAY;
   m_bitShift = 4;
   m_gain = GAIN_TWOTHIRDS; /* +/- 6.144V range (limited to VDD +0.3V max!) */
+  m_dataRate = ADS1015_REG_CONFIG_DR_1600SPS; /* 1600 SPS (ADS1015), 128 SPS (ADS1115) */
 }
 
 /**************************************************************************/
@@ -134,6 +140,7 @@ Adafruit_ADS1115::Adafruit_ADS1115(uint8_t i2cAddress)
   m_conversionDelay = ADS1115_CONVERSIONDELAY;
   m_bitShift = 0;
   m_gain = GAIN_TWOTHIRDS; /* +/- 6.144V range (limited to VDD +0.3V max!) */
+  m_dataRate = ADS1015_REG_CONFIG_DR_1600SPS; /* 1600 SPS (ADS1015), 128 SPS (ADS1115) */
 }
 
 /**************************************************************************/
@@ -161,6 +168,30 @@ void Adafruit_ADS1015::setGain(adsGain_t gain) { m_gain = gain; }
 /**************************************************************************/
 adsGain_t Adafruit_ADS1015::getGain() { return m_gain; }
 
+/**************************************************************************/
+/*!
+    @brief  Sets the data rate and the matching conversion delay
+
+    @param rate data rate config bits, ADS1015_REG_CONFIG_DR_* for the
+           ADS1015 or RATE_ADS1115_* for the ADS1115
+*/
+/**************************************************************************/
+void Adafruit_ADS1015::setDataRate(uint16_t rate)
+{
+  m_dataRate = rate & ADS1015_REG_CONFIG_DR_MASK;
+  m_conversionDelay = ads1x15::conversionDelay(
+      (m_bitShift == 0) ? CHIP_ADS1115 : CHIP_ADS1015, m_dataRate);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Gets the data rate
+
+    @return the data rate config bits
+*/
+/**************************************************************************/
+uint16_t Adafruit_ADS1015::getDataRate() { return m_dataRate; }
+
 /**************************************************************************/
 /*!
     @brief  Gets a single-ended ADC reading from the specified channel
@@ -177,37 +208,9 @@ uint16_t Adafruit_ADS1015::readADC_SingleEnded(uint8_t channel)
     return 0;
   }
 
-  // Start with default values
-  uint16_t config =
-      ADS1015_REG_CONFIG_CQUE_NONE |    // Disable the comparator (default val)
-      ADS1015_REG_CONFIG_CLAT_NONLAT |  // Non-latching (default val)
-      ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
-      ADS1015_REG_CONFIG_CMODE_TRAD |   // Traditional comparator (default val)
-      ADS1015_REG_CONFIG_DR_1600SPS |   // 1600 samples per second (default)
-      ADS1015_REG_CONFIG_MODE_SINGLE;   // Single-shot mode (default)
-
-  // Set PGA/voltage range
-  config |= m_gain;
-
-  // Set single-ended input channel
-  switch (channel)
-  {
-  case (0):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_0;
-    break;
-  case (1):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_1;
-    break;
-  case (2):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_2;
-    break;
-  case (3):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_3;
-    break;
-  }
-
-  // Set 'start single-conversion' bit
-  config |= ADS1015_REG_CONFIG_OS_SINGLE;
+  // Single-shot config with the comparator disabled, as in ADS1x15
+  uint16_t config = ads1x15::singleShotConfig(ads1x15::muxSingleEnded(channel),
+                                              m_gain, m_dataRate);
 
   // Write config register to the ADC
   writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
@@ -220,6 +223,67 @@ uint16_t Adafruit_ADS1015::readADC_SingleEnded(uint8_t channel)
   return readRegister(m_i2cAddress, ADS1015_REG_POINTER_CONVERT) >> m_bitShift;
 }
 
+/**************************************************************************/
+/*!
+    @brief  Starts a single-shot conversion on the specified channel and
+            returns without waiting. Poll conversionComplete() and fetch
+            the value with getConversionResult().
+
+    @param channel ADC channel to read
+*/
+/**************************************************************************/
+void Adafruit_ADS1015::startADC_SingleEnded(uint8_t channel)
+{
+  if (channel > 3)
+  {
+    return;
+  }
+
+  // Single-shot config with the comparator disabled, as in ADS1x15
+  uint16_t config = ads1x15::singleShotConfig(ads1x15::muxSingleEnded(channel),
+                                              m_gain, m_dataRate);
+
+  // Write config register to the ADC
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Puts the ADC in continuous conversion mode on the specified
+            channel. The latest value can then be fetched at any time with
+            getConversionResult().
+
+    @param channel ADC channel to read
+*/
+/**************************************************************************/
+void Adafruit_ADS1015::startADC_Continuous(uint8_t channel)
+{
+  if (channel > 3)
+  {
+    return;
+  }
+
+  // Continuous config with the comparator disabled
+  uint16_t config = ads1x15::continuousConfig(ads1x15::muxSingleEnded(channel),
+                                              m_gain, m_dataRate);
+
+  // Write config register to the ADC
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Checks whether the last single-shot conversion has finished
+
+    @return true once the conversion result is available
+*/
+/**************************************************************************/
+bool Adafruit_ADS1015::conversionComplete()
+{
+  return (readRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG) &
+          ADS1015_REG_CONFIG_OS_MASK) == ADS1015_REG_CONFIG_OS_NOTBUSY;
+}
+
 /**************************************************************************/
 /*!
     @brief  Reads the conversion results, measuring the voltage
@@ -238,11 +302,11 @@ int16_t Adafruit_ADS1015::readADC_Differential_0_1()
       ADS1015_REG_CONFIG_CLAT_NONLAT |  // Non-latching (default val)
       ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
       ADS1015_REG_CONFIG_CMODE_TRAD |   // Traditional comparator (default val)
-      ADS1015_REG_CONFIG_DR_1600SPS |   // 1600 samples per second (default)
       ADS1015_REG_CONFIG_MODE_SINGLE;   // Single-shot mode (default)
 
-  // Set PGA/voltage range
+  // Set PGA/voltage range and data rate
   config |= m_gain;
+  config |= m_dataRate;
 
   // Set channels
   config |= ADS1015_REG_CONFIG_MUX_DIFF_0_1; // AIN0 = P, AIN1 = N
@@ -294,11 +358,11 @@ int16_t Adafruit_ADS1015::readADC_Differential_2_3()
       ADS1015_REG_CONFIG_CLAT_NONLAT |  // Non-latching (default val)
       ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
       ADS1015_REG_CONFIG_CMODE_TRAD |   // Traditional comparator (default val)
-      ADS1015_REG_CONFIG_DR_1600SPS |   // 1600 samples per second (default)
       ADS1015_REG_CONFIG_MODE_SINGLE;   // Single-shot mode (default)
 
-  // Set PGA/voltage range
+  // Set PGA/voltage range and data rate
   config |= m_gain;
+  config |= m_dataRate;
 
   // Set channels
   config |= ADS1015_REG_CONFIG_MUX_DIFF_2_3; // AIN2 = P, AIN3 = N
@@ -332,6 +396,70 @@ int16_t Adafruit_ADS1015::readADC_Differential_2_3()
   }
 }
 
+/**************************************************************************/
+/*!
+    @brief  Starts a single-shot conversion of the voltage difference
+            between the P (AIN0) and N (AIN1) input and returns without
+            waiting. The signed result is fetched with
+            getConversionResult().
+*/
+/**************************************************************************/
+void Adafruit_ADS1015::startADC_Differential_0_1()
+{
+  // Start with default values
+  uint16_t config =
+      ADS1015_REG_CONFIG_CQUE_NONE |    // Disable the comparator (default val)
+      ADS1015_REG_CONFIG_CLAT_NONLAT |  // Non-latching (default val)
+      ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
+      ADS1015_REG_CONFIG_CMODE_TRAD |   // Traditional comparator (default val)
+      ADS1015_REG_CONFIG_MODE_SINGLE;   // Single-shot mode (default)
+
+  // Set PGA/voltage range and data rate
+  config |= m_gain;
+  config |= m_dataRate;
+
+  // Set channels
+  config |= ADS1015_REG_CONFIG_MUX_DIFF_0_1; // AIN0 = P, AIN1 = N
+
+  // Set 'start single-conversion' bit
+  config |= ADS1015_REG_CONFIG_OS_SINGLE;
+
+  // Write config register to the ADC
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
+}
+
+/**************************************************************************/
+/*!
+    @brief  Starts a single-shot conversion of the voltage difference
+            between the P (AIN2) and N (AIN3) input and returns without
+            waiting. The signed result is fetched with
+            getConversionResult().
+*/
+/**************************************************************************/
+void Adafruit_ADS1015::startADC_Differential_2_3()
+{
+  // Start with default values
+  uint16_t config =
+      ADS1015_REG_CONFIG_CQUE_NONE |    // Disable the comparator (default val)
+      ADS1015_REG_CONFIG_CLAT_NONLAT |  // Non-latching (default val)
+      ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
+      ADS1015_REG_CONFIG_CMODE_TRAD |   // Traditional comparator (default val)
+      ADS1015_REG_CONFIG_MODE_SINGLE;   // Single-shot mode (default)
+
+  // Set PGA/voltage range and data rate
+  config |= m_gain;
+  config |= m_dataRate;
+
+  // Set channels
+  config |= ADS1015_REG_CONFIG_MUX_DIFF_2_3; // AIN2 = P, AIN3 = N
+
+  // Set 'start single-conversion' bit
+  config |= ADS1015_REG_CONFIG_OS_SINGLE;
+
+  // Write config register to the ADC
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
+}
+
 /**************************************************************************/
 /*!
     @brief  Sets up the comparator to operate in basic mode, causing the
@@ -354,29 +482,15 @@ void Adafruit_ADS1015::startComparator_SingleEnded(uint8_t channel,
       ADS1015_REG_CONFIG_CLAT_LATCH |   // Latching mode
       ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
       ADS1015_REG_CONFIG_CMODE_TRAD |   // Traditional comparator (default val)
-      ADS1015_REG_CONFIG_DR_1600SPS |   // 1600 samples per second (default)
       ADS1015_REG_CONFIG_MODE_CONTIN |  // Continuous conversion mode
       ADS1015_REG_CONFIG_MODE_CONTIN;   // Continuous conversion mode
 
-  // Set PGA/voltage range
+  // Set PGA/voltage range and data rate
   config |= m_gain;
+  config |= m_dataRate;
 
   // Set single-ended input channel
-  switch (channel)
-  {
-  case (0):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_0;
-    break;
-  case (1):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_1;
-    break;
-  case (2):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_2;
-    break;
-  case (3):
-    config |= ADS1015_REG_CONFIG_MUX_SINGLE_3;
-    break;
-  }
+  config |= ads1x15::muxSingleEnded(channel);
 
   // Set the high threshold register
   // Shift 12-bit results left 4 bits for the ADS1015
@@ -387,6 +501,51 @@ void Adafruit_ADS1015::startComparator_SingleEnded(uint8_t channel,
   writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
 }
 
+/**************************************************************************/
+/*!
+    @brief  Sets up the comparator to operate in window mode, causing the
+            ALERT/RDY pin to assert (go from high to low) when the ADC
+            value leaves the band between the two thresholds. The alert
+            is latched until the conversion register is read.
+
+            This will also set the ADC in continuous conversion mode.
+
+    @param channel ADC channel to use
+    @param lowThreshold lower comparator threshold
+    @param highThreshold upper comparator threshold
+*/
+/**************************************************************************/
+void Adafruit_ADS1015::startComparator_Window(uint8_t channel,
+                                              int16_t lowThreshold,
+                                              int16_t highThreshold)
+{
+  // Start with default values
+  uint16_t config =
+      ADS1015_REG_CONFIG_CQUE_1CONV |   // Comparator enabled and asserts on 1
+                                        // match
+      ADS1015_REG_CONFIG_CLAT_LATCH |   // Latching mode
+      ADS1015_REG_CONFIG_CPOL_ACTVLOW | // Alert/Rdy active low   (default val)
+      ADS1015_REG_CONFIG_CMODE_WINDOW | // Window comparator
+      ADS1015_REG_CONFIG_MODE_CONTIN;   // Continuous conversion mode
+
+  // Set PGA/voltage range and data rate
+  config |= m_gain;
+  config |= m_dataRate;
+
+  // Set single-ended input channel
+  config |= ads1x15::muxSingleEnded(channel);
+
+  // Set the threshold registers
+  // Shift 12-bit results left 4 bits for the ADS1015
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_LOWTHRESH,
+                lowThreshold << m_bitShift);
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_HITHRESH,
+                highThreshold << m_bitShift);
+
+  // Write config register to the ADC
+  writeRegister(m_i2cAddress, ADS1015_REG_POINTER_CONFIG, config);
+}
+
 /**************************************************************************/
 /*!
     @brief  In order to clear the comparator, we need to read the
@@ -420,3 +579,19 @@ int16_t Adafruit_ADS1015::getLastConversionResults()
     return (int16_t)res;
   }
 }
+
+/**************************************************************************/
+/*!
+    @brief  Reads the conversion register immediately, without waiting for
+            a conversion to complete. Use in continuous mode, or once the
+            ALERT/RDY pin has signalled. Also clears a latched comparator.
+
+    @return the last ADC reading
+*/
+/**************************************************************************/
+int16_t Adafruit_ADS1015::getConversionResult()
+{
+  // Read the conversion results, sign extending 12-bit ADS1015 results
+  return ads1x15::conversionValue(
+      readRegister(m_i2cAddress, ADS1015_REG_POINTER_CONVERT), m_bitShift);
+}
@@ -93,6 +93,15 @@
 #define ADS1015_REG_CONFIG_DR_2400SPS (0x00A0) ///< 2400 samples per second
 #define ADS1015_REG_CONFIG_DR_3300SPS (0x00C0) ///< 3300 samples per second
 
+#define RATE_ADS1115_8SPS (0x0000)   ///< 8 samples per second
+#define RATE_ADS1115_16SPS (0x0020)  ///< 16 samples per second
+#define RATE_ADS1115_32SPS (0x0040)  ///< 32 samples per second
+#define RATE_ADS1115_64SPS (0x0060)  ///< 64 samples per second
+#define RATE_ADS1115_128SPS (0x0080) ///< 128 samples per second (default)
+#define RATE_ADS1115_250SPS (0x00A0) ///< 250 samples per second
+#define RATE_ADS1115_475SPS (0x00C0) ///< 475 samples per second
+#define RATE_ADS1115_860SPS (0x00E0) ///< 860 samples per second
+
 #define ADS1015_REG_CONFIG_CMODE_MASK (0x0010) ///< CMode Mask
 #define ADS1015_REG_CONFIG_CMODE_TRAD \
     (0x0000)                                     ///< Traditional comparator with hysteresis (default)
@@ -132,6 +141,74 @@ typedef enum
     GAIN_SIXTEEN = ADS1015_REG_CONFIG_PGA_0_256V
 } adsGain_t;
 
+/** Chip variants */
+typedef enum
+{
+    CHIP_ADS1015,
+    CHIP_ADS1115
+} adsChip_t;
+
+/*=========================================================================
+    CONFIG WORD HELPERS
+    Shared by the runtime classes and the ADS1x15 template, constant
+    folded when the arguments are compile-time constants
+    -----------------------------------------------------------------------*/
+namespace ads1x15
+{
+/** Conversion delay (ms) per data rate setting, rounded up with one ms margin */
+constexpr uint8_t ADS1015_DELAY[8] = {8, 5, 3, 2, 1, 1, 1, 1};
+constexpr uint8_t ADS1115_DELAY[8] = {126, 63, 33, 17, 9, 5, 3, 2}; ///< ADS1115
+
+/** Mux bits of a single-ended channel (0 to 3) */
+constexpr uint16_t muxSingleEnded(uint8_t channel)
+{
+    return ADS1015_REG_CONFIG_MUX_SINGLE_0 | ((uint16_t)(channel & 0x03) << 12);
+}
+
+/** Config word starting a single-shot conversion, comparator disabled */
+constexpr uint16_t singleShotConfig(uint16_t mux, uint16_t gain, uint16_t rate)
+{
+    return ADS1015_REG_CONFIG_CQUE_NONE | ADS1015_REG_CONFIG_CLAT_NONLAT |
+           ADS1015_REG_CONFIG_CPOL_ACTVLOW | ADS1015_REG_CONFIG_CMODE_TRAD |
+           ADS1015_REG_CONFIG_MODE_SINGLE | gain | rate | mux |
+           ADS1015_REG_CONFIG_OS_SINGLE;
+}
+
+/** Config word for continuous conversion, comparator disabled */
+constexpr uint16_t continuousConfig(uint16_t mux, uint16_t gain, uint16_t rate)
+{
+    return ADS1015_REG_CONFIG_CQUE_NONE | ADS1015_REG_CONFIG_CLAT_NONLAT |
+           ADS1015_REG_CONFIG_CPOL_ACTVLOW | ADS1015_REG_CONFIG_CMODE_TRAD |
+           ADS1015_REG_CONFIG_MODE_CONTIN | gain | rate | mux;
+}
+
+/** Right shift of the conversion register, 12-bit results for the ADS1015 */
+constexpr uint8_t bitShift(adsChip_t chip) { return chip == CHIP_ADS1015 ? 4 : 0; }
+
+/** Conversion delay (ms) of a chip at a data rate setting */
+constexpr uint8_t conversionDelay(adsChip_t chip, uint16_t rate)
+{
+    return chip == CHIP_ADS1015
+               ? ADS1015_DELAY[(rate & ADS1015_REG_CONFIG_DR_MASK) >> 5]
+               : ADS1115_DELAY[(rate & ADS1015_REG_CONFIG_DR_MASK) >> 5];
+}
+
+/** Writes a 16-bit register, defined in Adafruit_ADS1015.cpp */
+void writeRegister(uint8_t i2cAddress, uint8_t reg, uint16_t value);
+
+/** Reads a 16-bit register, defined in Adafruit_ADS1015.cpp */
+uint16_t readRegister(uint8_t i2cAddress, uint8_t reg);
+
+/** Signed value of a conversion register, sign extending 12-bit results */
+constexpr int16_t conversionValue(uint16_t raw, uint8_t shift)
+{
+    return shift == 0 ? (int16_t)raw
+                      : (int16_t)((raw >> shift) > 0x07FF ? ((raw >> shift) | 0xF000)
+                                                          : (raw >> shift));
+}
+} // namespace ads1x15
+/*=========================================================================*/
+
 /**************************************************************************/
 /*!
     @brief  Sensor driver for the Adafruit ADS1015 ADC breakout.
@@ -145,17 +222,28 @@ protected:
     uint8_t m_conversionDelay; ///< conversion deay
     uint8_t m_bitShift;        ///< bit shift amount
     adsGain_t m_gain;          ///< ADC gain
+    uint16_t m_dataRate;       ///< data rate config bits
 
 public:
     Adafruit_ADS1015(uint8_t i2cAddress = ADS1015_ADDRESS);
     void begin(void);
     uint16_t readADC_SingleEnded(uint8_t channel);
+    void startADC_SingleEnded(uint8_t channel);
+    bool conversionComplete(void);
+    void startADC_Continuous(uint8_t channel);
+    void startADC_Differential_0_1(void);
+    void startADC_Differential_2_3(void);
     int16_t readADC_Differential_0_1(void);
     int16_t readADC_Differential_2_3(void);
     void startComparator_SingleEnded(uint8_t channel, int16_t threshold);
+    void startComparator_Window(uint8_t channel, int16_t lowThreshold,
+                                int16_t highThreshold);
     int16_t getLastConversionResults();
+    int16_t getConversionResult();
     void setGain(adsGain_t gain);
     adsGain_t getGain(void);
+    void setDataRate(uint16_t rate);
+    uint16_t getDataRate(void);
 
 private:
 };
@@ -173,4 +261,68 @@ public:
 private:
 };
 
-#endif
\ No newline at end of file
+/**************************************************************************/
+/*!
+    @brief  ADS1x15 driver specialized at compile time for one chip, I2C
+            address, single-ended channel, gain and data rate. The config
+            word, bit shift and conversion delay are constants; register
+            access goes through the same functions as the runtime classes.
+*/
+/**************************************************************************/
+template <adsChip_t Chip, uint8_t Address, uint8_t Channel, adsGain_t Gain,
+          uint16_t Rate>
+class ADS1x15
+{
+    static_assert(Channel < 4, "ADS1x15 single-ended channel must be 0 to 3");
+
+public:
+    static constexpr uint16_t config = ads1x15::singleShotConfig(
+        ads1x15::muxSingleEnded(Channel), Gain, Rate); ///< config word
+    static constexpr uint8_t bitShift = ads1x15::bitShift(Chip); ///< bit shift
+    static constexpr uint8_t conversionDelay =
+        ads1x15::conversionDelay(Chip, Rate); ///< conversion delay (ms)
+
+    /** Sets up the HW */
+    static void begin(void) { Wire.begin(); }
+
+    /** Starts a single-shot conversion and returns without waiting */
+    static void startADC(void)
+    {
+        ads1x15::writeRegister(Address, ADS1015_REG_POINTER_CONFIG, config);
+    }
+
+    /** Checks whether the last single-shot conversion has finished */
+    static bool conversionComplete(void)
+    {
+        return (ads1x15::readRegister(Address, ADS1015_REG_POINTER_CONFIG) &
+                ADS1015_REG_CONFIG_OS_MASK) == ADS1015_REG_CONFIG_OS_NOTBUSY;
+    }
+
+    /** Reads the conversion register without waiting */
+    static int16_t getConversionResult(void)
+    {
+        return ads1x15::conversionValue(
+            ads1x15::readRegister(Address, ADS1015_REG_POINTER_CONVERT),
+            bitShift);
+    }
+
+    /** Starts a conversion, waits for it and returns the result */
+    static int16_t readADC(void)
+    {
+        startADC();
+        delay(conversionDelay);
+        return getConversionResult();
+    }
+};
+
+template <adsChip_t Chip, uint8_t Address, uint8_t Channel, adsGain_t Gain,
+          uint16_t Rate>
+constexpr uint16_t ADS1x15<Chip, Address, Channel, Gain, Rate>::config;
+template <adsChip_t Chip, uint8_t Address, uint8_t Channel, adsGain_t Gain,
+          uint16_t Rate>
+constexpr uint8_t ADS1x15<Chip, Address, Channel, Gain, Rate>::bitShift;
+template <adsChip_t Chip, uint8_t Address, uint8_t Channel, adsGain_t Gain,
+          uint16_t Rate>
+constexpr uint8_t ADS1x15<Chip, Address, Channel, Gain, Rate>::conversionDelay;
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef RunningMedian_h
+#define RunningMedian_h
+
+#include <stdint.h>
+
+/*
+  Median of the last N values, updated in O(N) per value without re-sorting.
+
+  The window is kept twice: in arrival order (circular) to know which value
+  leaves, and sorted to read the median. A new value takes the place of the
+  one leaving in the sorted copy and is moved into order by swapping with its
+  neighbours, which touches at most N entries.
+
+  Until N values have arrived, the median of the values so far is returned.
+  Use an odd N so the median is a sample rather than an interpolation.
+*/
+template <uint8_t N>
+class RunningMedian
+{
+public:
+  RunningMedian() { reset(); }
+
+  void reset()
+  {
+    m_head = 0;
+    m_count = 0;
+  }
+
+  // Add a value, dropping the oldest once the window is full, and return the new median
+  int16_t add(int16_t value)
+  {
+    uint8_t position;
+    if (m_count < N)
+    {
+      position = m_count;
+      m_count++;
+    }
+    else
+    {
+      position = find(m_window[m_head]);
+    }
+
+    m_window[m_head] = value;
+    m_head = (m_head + 1) % N;
+
+    // Replace the leaving value in the sorted copy, then restore order
+    m_sorted[position] = value;
+    while (position > 0 && m_sorted[position - 1] > value)
+    {
+      m_sorted[position] = m_sorted[position - 1];
+      m_sorted[--position] = value;
+    }
+    while (position + 1 < m_count && m_sorted[position + 1] < value)
+    {
+      m_sorted[position] = m_sorted[position + 1];
+      m_sorted[++position] = value;
+    }
+
+    return median();
+  }
+
+  int16_t median() const { return m_sorted[m_count / 2]; }
+
+  uint8_t count() const { return m_count; }
+
+private:
+  // Binary search of the sorted copy, the value is known to be present
+  uint8_t find(int16_t value) const
+  {
+    uint8_t low = 0;
+    uint8_t high = m_count - 1;
+    while (low < high)
+    {
+      uint8_t middle = (low + high) / 2;
+      if (m_sorted[middle] < value)
+      {
+        low = middle + 1;
+      }
+      else
+      {
+        high = middle;
+      }
+    }
+    return low;
+  }
+
+  int16_t m_window[N]; // Values in arrival order, m_head is the oldest once full
+  int16_t m_sorted[N]; // The same values in increasing order
+  uint8_t m_head;
+  uint8_t m_count;
+};
+
+#endif
@@ -14,24 +14,25 @@
 #include <Arduino.h>
 #include <Wire.h>
 #include <SPI.h>
+#include <EEPROM.h>
 #include <Adafruit_ADS1015.h>
 #include <ArduinoSort.h>
+#include <RunningMedian.h>
 
 Adafruit_ADS1115 ads1115(0x48); // Instantiate ADS1115
 
-// const float multiplier = 0.1875e-3F; // GAIN_TWOTHIRDS
-// const float multiplier = 0.125e-3F; // GAIN_ONE
-// const float multiplier = 0.0625e-3F; // GAIN_TWO
-const float multiplier = 0.03125e-3F; // GAIN_FOUR
-// const float multiplier = 0.015625e-3F; // GAIN_EIGHT
-// const float multiplier = 0.0078125e-3F; // GAIN_SIXTEEN
+float multiplier;              // Volts per ADC code, set from the full-scale range
+unsigned long conversionMicros; // Shortest time one conversion can take at the data rate (us)
 
 // Initialize values for signal acquisition
 const float rRef = 22e3; // Reference resistor in current follower
 int16_t adc;             // Readout from ADC channel
 float v;                 // Converted voltage value
-float iSenArray[11];     // Array of sensor values
-int iSenArrayIndex;      // Index value of sensor array
+int16_t adcArray[11];    // Array of sensor ADC codes
+int16_t adcArray2[11];   // Array of sensor ADC codes from the second differential pair
+RunningMedian<11> runningMedian;  // Sliding median over the last 11 codes
+RunningMedian<11> runningMedian2; // Sliding median of the second differential pair
+int adcArrayIndex;       // Index value of sensor array
 
 unsigned long timeStart, timeExperiment; // Time tracking variables
 
@@ -41,6 +42,122 @@ int medianUser;
 int amplitudeUser;
 int frequencyUser;
 int debug;
+int windowUser;    // Half-width of event window (nA)
+int heartbeatUser; // Heartbeat period in event mode (s)
+int setpointUser;  // Target current in control mode (nA)
+int kpUser;        // Proportional gain (DAC steps per 256 codes of error)
+int kiUser;        // Integral gain (DAC steps per 256 codes of error per period)
+int controlUser;   // Control period (ms)
+int rangeUser;     // ADC full-scale range (mV)
+int rateUser;      // ADC data rate (SPS)
+int formatUser;    // Output format: 0 current (uA), 1 raw ADC codes
+int autostartUser; // Start acquisition with the stored configuration on boot
+int policyUser;    // Output backpressure policy: 0 drop newest, 1 drop oldest, 2 decimate
+int inputUser;     // ADC input: 0 single-ended AIN0, 1 differential AIN0-AIN1 and AIN2-AIN3
+int statsUser;     // Append window statistics to median records when nonzero
+int filterUser;    // Median filter: 0 one record per block of 11, 1 running median per conversion
+
+// Configuration stored in EEPROM, restored on boot
+const uint8_t configVersion = 5; // Bump when StoredConfig changes layout
+const int configAddress = 0;
+
+struct StoredConfig
+{
+  uint8_t version;
+  char setting;
+  int median;
+  int amplitude;
+  int frequency;
+  int debug;
+  int window;
+  int heartbeat;
+  int setpoint;
+  int kp;
+  int ki;
+  int control;
+  int range;
+  int rate;
+  int format;
+  int autostart;
+  int policy;
+  int input;
+  int stats;
+  int filter;
+  uint16_t checksum;
+};
+
+String setupMessage;         // Setup message being received
+boolean setupInProgress = false;
+const uint8_t setupMessageMax = 96; // Longer messages are abandoned, so the heap String never grows past this
+
+// Replies to host messages, sent by serialPoll() once any partly written record is complete
+const uint8_t replyNone = 0;
+const uint8_t replySync = 1;  // Clock sync answer to <y;seq>
+const uint8_t replyHello = 2; // Capabilities, on boot and on <h>
+const uint8_t replyNak = 3;   // Message with an unknown setting ignored
+uint8_t replyRequested;
+boolean ackPending;             // Setup message accepted, acknowledged once it is applied
+long syncSequence;              // Sequence number echoed in the answer
+unsigned long timeSyncReceived; // Time the ping was received (us)
+
+// Capabilities announced in the hello line, bump protocolVersion when messages or records change
+const uint8_t protocolVersion = 1;
+const char readerModes[] = "csepw";
+const long serialBaud = 500000;
+const uint8_t serialTxBuffer = 64; // HardwareSerial TX buffer on the Uno
+
+// Output queue, samples wait here until the TX buffer has room so acquisition never blocks
+const uint8_t queueSize = 8;
+const uint8_t policyDropNewest = 0;
+const uint8_t policyDropOldest = 1;
+const uint8_t policyDecimate = 2;
+const uint8_t decimationMax = 64;
+
+enum SampleColumns
+{
+  columnsValue,    // time,value
+  columnsTag,      // time,value,tag
+  columnsIndex,    // time,value,dac_index
+  columnsIndexLag, // time,value,dac_index,lag
+  columnsChannel   // time,value,channel
+};
+
+// Statistics of the codes in one median block, updated as each code arrives
+struct WindowStats
+{
+  uint8_t count;
+  float mean;
+  float m2; // Sum of squared deviations from the mean
+  int16_t min;
+  int16_t max;
+};
+
+struct Sample
+{
+  unsigned long time;
+  int16_t code;
+  uint16_t indexDAC;
+  uint8_t columns;
+  char extra;        // Tag, lag or channel
+  WindowStats stats; // Appended to the record when count is nonzero
+};
+
+Sample sampleQueue[queueSize];
+uint8_t queueHead;              // Oldest queued sample
+uint8_t queueCount;
+char pendingLine[80];           // Formatted sample waiting for TX buffer room
+uint8_t pendingLength;
+uint8_t pendingOffset;          // Bytes of pendingLine already written
+unsigned long samplesDropped;   // Samples discarded because the queue was full
+unsigned long samplesMerged;    // Samples averaged into another by decimation
+unsigned long samplesReported;  // Dropped plus merged at the last #drop record
+unsigned long timeDropReport;
+uint8_t decimation = 1;         // Samples averaged into each queued sample
+uint8_t decimationCount[2];     // Per channel, so the differential pairs are averaged apart
+long decimationSum[2];
+uint8_t queueIdleRuns;          // Consecutive queued samples that found the queue empty
+WindowStats adcStats;           // Statistics of the block in adcArray
+WindowStats adcStats2;          // Statistics of the block in adcArray2
 
 // DAC and gating parameters
 uint16_t dacRes = 4096;      // Resolution (minimum step size) of 12 bit DAC
@@ -50,6 +167,13 @@ uint16_t indexTopLim;        // Gate top limit index (positive voltage input)
 uint16_t indexBtmLim;        // Gate bottom limit index (negative voltage input)
 uint16_t indexDAC;           // Index value to set DAC output
 uint16_t stepSize;           // Step size for gate sweep
+uint16_t indexConversion;    // DAC index applied while the current conversion runs
+uint16_t indexBlock;         // DAC index of the middle conversion in a median block
+uint16_t indexHistory[11];   // DAC indices of the conversions in the running median window
+uint8_t indexHistoryHead;    // Where the next index goes
+
+// DAC steps are computed one conversion ahead of the conversion they are applied to
+const uint8_t pipelineLag = 1;
 
 // Variables for computing DAC index along waveform
 float periodUser;
@@ -60,12 +184,123 @@ int phase3;
 int phase4;
 
 const int chipSelectPin = 10; // DAC chip select pin
+const int alertPin = 2;       // ADS ALERT/RDY pin (INT0)
+
+// Event mode parameters
+int16_t adcBaseline;                // Code the comparator window is centered on
+unsigned long heartbeatPeriod;      // Interval between heartbeat records (ms)
+unsigned long timeHeartbeat;        // Time of last record sent in event mode
+volatile boolean alertFlag = false; // Set by ALERT/RDY interrupt
+
+// Closed-loop control parameters
+int16_t setpointCode;                   // Target current as ADC code
+long integral;                          // Integral term, scaled by 256
+const long integralLimit = 4095L * 256; // Integral term never exceeds full DAC range
+volatile boolean controlTick = false;   // Set by Timer1 at each control period
+volatile unsigned long timeTick;        // Time of last control tick (us)
+volatile uint16_t tickOverruns;         // Ticks raised before the previous was serviced
+unsigned long timeStats;                // Time of last loop statistics record
+unsigned long latencyMin;               // Tick to DAC write latency statistics (us)
+unsigned long latencyMax;
+unsigned long latencySum;
+uint16_t latencyCount;
+
+// Waveform playback parameters
+const uint8_t segmentCapacity = 48; // Points per waveform segment buffer
+const uint8_t segmentFinal = 0x01;  // Segment flag: stop playback after this segment
+const uint8_t segmentRepeat = 0x02; // Segment flag: repeat until the next segment is uploaded
+
+struct WaveformPoint
+{
+  uint16_t index; // DAC index
+  uint16_t dwell; // Time the index is held (10 us units)
+};
+
+struct WaveformSegment
+{
+  WaveformPoint points[segmentCapacity];
+  uint8_t count;
+  uint8_t flags;
+  boolean ready; // Uploaded and not yet played out
+};
+
+// Segment upload frame: '{' count flags points[count] checksum '}', points little endian
+enum UploadState
+{
+  uploadIdle,
+  uploadCount,
+  uploadFlags,
+  uploadData,
+  uploadChecksum,
+  uploadEnd,
+  uploadSkip // Rest of a rejected frame, so its payload is not read as setup messages
+};
+
+WaveformSegment segments[2];     // Double buffer: one plays while the other is uploaded
+uint8_t segmentPlaying;          // Buffer being played
+uint8_t segmentFill;             // Buffer the next upload goes to
+uint8_t pointPlaying;            // Point being played within segmentPlaying
+boolean wavePlaying;             // Playback started and not finished
+unsigned long timePoint;         // Time the playing point was scheduled (us)
+unsigned long timeConversion;    // Time the running conversion was started (us)
+uint16_t segmentUnderruns;       // Segment ends reached before the next segment arrived
+uint8_t waveNextPending;         // #next lines not yet written
+boolean waveUnderrunPending;     // #underrun line not yet written
+boolean waveDonePending;         // #done line not yet written
+UploadState uploadState = uploadIdle;
+uint16_t uploadPosition;         // Bytes of point data received, or left to skip
+uint8_t uploadSize;              // Points announced in the frame
+uint8_t uploadSum;               // Running checksum of count, flags and point data
+
+float codeToCurrent(int16_t code)
+{
+  v = (float)code * multiplier; // Calculate voltage using multiplier
+  return v / rRef * 1.0e6;      // Convert signal to current based on output voltage and reference resistor
+}
 
-float readADC()
+int16_t currentToCode(float iSen)
+{
+  // Currents beyond full scale saturate at the end codes, a float to int16_t cast out of range is undefined
+  float code = round(iSen * 1.0e-6 * rRef / multiplier);
+  return (int16_t)constrain(code, -32768.0, 32767.0);
+}
+
+int16_t readADC()
 {
   adc = ads1115.readADC_SingleEnded(0); // Read ADC Channel 0
-  v = (float)adc * multiplier;          // Calculate voltage using multiplier
-  return v / rRef * 1.0e6;              // Convert signal to current based on output voltage and reference resistor
+  return adc;
+}
+
+void startADC()
+{
+  ads1115.startADC_SingleEnded(0); // Start a conversion on ADC Channel 0 without waiting for it
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+  if (controlTick)
+  {
+    tickOverruns++;
+  }
+  controlTick = true;
+  timeTick = micros();
+}
+
+void startDifferential(uint8_t pair)
+{
+  if (pair == 0)
+  {
+    ads1115.startADC_Differential_0_1();
+  }
+  else
+  {
+    ads1115.startADC_Differential_2_3();
+  }
+}
+
+void alertISR()
+{
+  alertFlag = true; // Comparator window left, serviced in loop
 }
 
 void writeDAC(uint16_t data, uint8_t chipSelectPin)
@@ -84,6 +319,76 @@ void writeDAC(uint16_t data, uint8_t chipSelectPin)
   digitalWrite(chipSelectPin, HIGH); // Deselect DAC
 }
 
+void setupADC()
+{
+  // Full-scale range selects the PGA gain, and with it the code to voltage multiplier
+  adsGain_t gain;
+  int range = rangeUser;
+  switch (range)
+  {
+  case (6144):
+    gain = GAIN_TWOTHIRDS;
+    break;
+  case (4096):
+    gain = GAIN_ONE;
+    break;
+  case (2048):
+    gain = GAIN_TWO;
+    break;
+  case (512):
+    gain = GAIN_EIGHT;
+    break;
+  case (256):
+    gain = GAIN_SIXTEEN;
+    break;
+  default:
+    range = 1024;
+    gain = GAIN_FOUR;
+    break;
+  }
+  multiplier = (float)range * 1.0e-3 / 32768.0;
+  ads1115.setGain(gain);
+
+  uint16_t rateBits;
+  int rate = rateUser;
+  switch (rate)
+  {
+  case (8):
+    rateBits = RATE_ADS1115_8SPS;
+    break;
+  case (16):
+    rateBits = RATE_ADS1115_16SPS;
+    break;
+  case (32):
+    rateBits = RATE_ADS1115_32SPS;
+    break;
+  case (64):
+    rateBits = RATE_ADS1115_64SPS;
+    break;
+  case (250):
+    rateBits = RATE_ADS1115_250SPS;
+    break;
+  case (475):
+    rateBits = RATE_ADS1115_475SPS;
+    break;
+  case (860):
+    rateBits = RATE_ADS1115_860SPS;
+    break;
+  default:
+    rate = 128;
+    rateBits = RATE_ADS1115_128SPS;
+    break;
+  }
+  ads1115.setDataRate(rateBits);
+  conversionMicros = 900000UL / rate; // ADS1115 oscillator is within 10%
+
+  if (debug)
+  {
+    Serial.print(F("Range: ")); Serial.println(range);
+    Serial.print(F("Rate: ")); Serial.println(rate);
+  }
+}
+
 void setupDAC()
 {
   float vRefDAC = 1182.0;                     // Value of vRef for the DAC
@@ -92,8 +397,8 @@ void setupDAC()
 
   if (debug)
   {
-    Serial.print("vRefDAC: "); Serial.println(vRefDAC);
-    Serial.print("smallStep: "); Serial.println(smallStep);
+    Serial.print(F("vRefDAC: ")); Serial.println(vRefDAC);
+    Serial.print(F("smallStep: ")); Serial.println(smallStep);
   }
   
   // indexMedian must be determined for both constant and sweep states
@@ -101,7 +406,7 @@ void setupDAC()
 
   if (debug)
   {
-    Serial.print("Index median: "); Serial.println(indexMedian);
+    Serial.print(F("Index median: ")); Serial.println(indexMedian);
   }
 
   // Setup for sweep and transfer curve settings
@@ -119,19 +424,30 @@ void setupDAC()
 
     if (debug)
     {
-      Serial.print("Index top limit: "); Serial.println(indexTopLim);
-      Serial.print("Index bottom limit: "); Serial.println(indexBtmLim);
+      Serial.print(F("Index top limit: ")); Serial.println(indexTopLim);
+      Serial.print(F("Index bottom limit: ")); Serial.println(indexBtmLim);
 
-      Serial.print("Phase1: "); Serial.println(phase1);
-      Serial.print("Phase2: "); Serial.println(phase2);
-      Serial.print("Phase3: "); Serial.println(phase3);
-      Serial.print("Phase4: "); Serial.println(phase4);
+      Serial.print(F("Phase1: ")); Serial.println(phase1);
+      Serial.print(F("Phase2: ")); Serial.println(phase2);
+      Serial.print(F("Phase3: ")); Serial.println(phase3);
+      Serial.print(F("Phase4: ")); Serial.println(phase4);
       
-      Serial.print("Period: "); Serial.println(periodUser, 3);
+      Serial.print(F("Period: ")); Serial.println(periodUser, 3);
     }
   }
 }
 
+void serialCompleteLine()
+{
+  // Finish a partly written sample line before a status line is printed
+  if (pendingLength > 0)
+  {
+    Serial.write((const uint8_t *)pendingLine + pendingOffset, pendingLength - pendingOffset);
+    pendingLength = 0;
+    pendingOffset = 0;
+  }
+}
+
 uint16_t sweepIndex(unsigned long timeExperiment)
 {
   interval = fmod(timeExperiment, periodUser) / periodUser; // Find point in waveform
@@ -156,83 +472,834 @@ uint16_t sweepIndex(unsigned long timeExperiment)
 
   if (debug)
   {
-    Serial.print("DAC index: "); Serial.println(indexDAC);
+    serialCompleteLine();
+    Serial.print(F("DAC index: ")); Serial.println(indexDAC);
   }
 
   return indexDAC;
 }
 
-void serialReadSetup()
+String nextField(const String &dataStr, int &cursor)
+{
+  // Return the ';' delimited field starting at cursor and move cursor past it
+  int delim = dataStr.indexOf(';', cursor);
+  if (delim < 0)
+  {
+    delim = dataStr.length();
+  }
+  String field = dataStr.substring(cursor, delim);
+  cursor = delim + 1;
+  return field;
+}
+
+boolean serialReadSetup(char dataChar)
 {
-  String dataStr = "";    // Variable that stores entire data transmission
-  char dataChar;          // Individual data character read from buffer
   char startMarker = '<'; // Indicates beginning of message
   char endMarker = '>';   // Indicates end of message
-  static boolean receiveInProgress = false;
+  unsigned long timeReceived;
 
-  // While data in serial buffer...
-  while (Serial.available() > 0)
+  // Collect one character at a time, so a message may arrive across several calls
+  if (setupInProgress == true)
   {
-    // Read individual character from stream, in sequence
-    dataChar = Serial.read();
-
-    if (receiveInProgress == true)
+    if (dataChar != endMarker)
     {
-      if (dataChar != endMarker)
+      if (setupMessage.length() >= setupMessageMax)
       {
-        dataStr += dataChar;
+        setupInProgress = false; // Not a setup message, or a corrupted one
+        return false;
       }
-      else
+      setupMessage += dataChar;
+      return false;
+    }
+    timeReceived = micros();
+    setupInProgress = false;
+  }
+  else
+  {
+    if (dataChar == startMarker)
+    {
+      setupMessage = "";
+      setupInProgress = true;
+    }
+    return false;
+  }
+
+  // Ignore messages for unknown settings so the running configuration stays valid
+  int cursor = 0;
+  String setting = nextField(setupMessage, cursor);
+  if (setting == "y")
+  {
+    // Clock sync ping, answered by serialPoll() without touching the configuration
+    timeSyncReceived = timeReceived;
+    syncSequence = nextField(setupMessage, cursor).toInt();
+    replyRequested = replySync;
+    return false;
+  }
+  if (setting == "h")
+  {
+    replyRequested = replyHello;
+    return false;
+  }
+  if (setting.length() != 1 || strchr(readerModes, setting[0]) == NULL)
+  {
+    replyRequested = replyNak;
+    return false;
+  }
+
+  // Extract data from transmission, fields missing at the end read as 0
+  readerSetting = setting;
+  medianUser = nextField(setupMessage, cursor).toInt();
+  amplitudeUser = nextField(setupMessage, cursor).toInt();
+  frequencyUser = nextField(setupMessage, cursor).toInt();
+  debug = nextField(setupMessage, cursor).toInt();
+  windowUser = nextField(setupMessage, cursor).toInt();
+  heartbeatUser = nextField(setupMessage, cursor).toInt();
+  setpointUser = nextField(setupMessage, cursor).toInt();
+  kpUser = nextField(setupMessage, cursor).toInt();
+  kiUser = nextField(setupMessage, cursor).toInt();
+  controlUser = nextField(setupMessage, cursor).toInt();
+  rangeUser = nextField(setupMessage, cursor).toInt();
+  rateUser = nextField(setupMessage, cursor).toInt();
+  formatUser = nextField(setupMessage, cursor).toInt();
+  autostartUser = nextField(setupMessage, cursor).toInt();
+  policyUser = nextField(setupMessage, cursor).toInt();
+  inputUser = nextField(setupMessage, cursor).toInt();
+  statsUser = nextField(setupMessage, cursor).toInt();
+  filterUser = nextField(setupMessage, cursor).toInt();
+
+  if (debug)
+  {
+    serialCompleteLine(); // Setup messages arrive while records are being written
+    Serial.print(F("Setting: ")); Serial.println(readerSetting);
+    Serial.print(F("Median: ")); Serial.println(medianUser);
+    Serial.print(F("Amplitude: ")); Serial.println(amplitudeUser);
+    Serial.print(F("Frequency: ")); Serial.println(frequencyUser);
+    Serial.print(F("Window: ")); Serial.println(windowUser);
+    Serial.print(F("Heartbeat: ")); Serial.println(heartbeatUser);
+    Serial.print(F("Setpoint: ")); Serial.println(setpointUser);
+    Serial.print(F("Kp: ")); Serial.println(kpUser);
+    Serial.print(F("Ki: ")); Serial.println(kiUser);
+    Serial.print(F("Control period: ")); Serial.println(controlUser);
+    Serial.print(F("Format: ")); Serial.println(formatUser);
+    Serial.print(F("Autostart: ")); Serial.println(autostartUser);
+    Serial.print(F("Policy: ")); Serial.println(policyUser);
+    Serial.print(F("Input: ")); Serial.println(inputUser);
+    Serial.print(F("Stats: ")); Serial.println(statsUser);
+    Serial.print(F("Filter: ")); Serial.println(filterUser);
+  }
+
+  ackPending = true;
+  return true;
+}
+
+uint16_t configChecksum(const StoredConfig &config)
+{
+  // Fletcher-16 over every byte before the checksum field
+  const uint8_t *data = (const uint8_t *)&config;
+  uint16_t sum1 = 0;
+  uint16_t sum2 = 0;
+  for (size_t i = 0; i < offsetof(StoredConfig, checksum); i++)
+  {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
+
+void saveConfig()
+{
+  StoredConfig config;
+  config.version = configVersion;
+  config.setting = readerSetting[0];
+  config.median = medianUser;
+  config.amplitude = amplitudeUser;
+  config.frequency = frequencyUser;
+  config.debug = debug;
+  config.window = windowUser;
+  config.heartbeat = heartbeatUser;
+  config.setpoint = setpointUser;
+  config.kp = kpUser;
+  config.ki = kiUser;
+  config.control = controlUser;
+  config.range = rangeUser;
+  config.rate = rateUser;
+  config.format = formatUser;
+  config.autostart = autostartUser;
+  config.policy = policyUser;
+  config.input = inputUser;
+  config.stats = statsUser;
+  config.filter = filterUser;
+  config.checksum = configChecksum(config);
+  EEPROM.put(configAddress, config); // Only bytes that changed are written
+}
+
+boolean loadConfig()
+{
+  StoredConfig config;
+  EEPROM.get(configAddress, config);
+  if (config.version != configVersion || config.checksum != configChecksum(config))
+  {
+    return false; // Blank, stale or corrupted EEPROM
+  }
+
+  readerSetting = String(config.setting);
+  medianUser = config.median;
+  amplitudeUser = config.amplitude;
+  frequencyUser = config.frequency;
+  debug = config.debug;
+  windowUser = config.window;
+  heartbeatUser = config.heartbeat;
+  setpointUser = config.setpoint;
+  kpUser = config.kp;
+  kiUser = config.ki;
+  controlUser = config.control;
+  rangeUser = config.range;
+  rateUser = config.rate;
+  formatUser = config.format;
+  autostartUser = config.autostart;
+  policyUser = config.policy;
+  inputUser = config.input;
+  statsUser = config.stats;
+  filterUser = config.filter;
+  return true;
+}
+
+uint8_t formatSample(const Sample &sample, char *line)
+{
+  // Format as the text line Serial.println would send, so its length is known up front
+  char *end = line;
+  ultoa(sample.time, end, 10);
+  end += strlen(end);
+  *end++ = ',';
+  if (formatUser == 1)
+  {
+    itoa(sample.code, end, 10);
+  }
+  else
+  {
+    dtostrf(codeToCurrent(sample.code), 1, 3, end);
+  }
+  end += strlen(end);
+
+  if (sample.columns == columnsTag)
+  {
+    *end++ = ',';
+    *end++ = sample.extra;
+  }
+  else if (sample.columns == columnsChannel)
+  {
+    *end++ = ',';
+    utoa((uint8_t)sample.extra, end, 10);
+    end += strlen(end);
+  }
+  else if (sample.columns == columnsIndex || sample.columns == columnsIndexLag)
+  {
+    *end++ = ',';
+    utoa(sample.indexDAC, end, 10);
+    end += strlen(end);
+    if (sample.columns == columnsIndexLag)
+    {
+      *end++ = ',';
+      utoa((uint8_t)sample.extra, end, 10);
+      end += strlen(end);
+    }
+  }
+
+  if (sample.stats.count > 0)
+  {
+    *end++ = ',';
+    utoa(sample.stats.count, end, 10);
+    end += strlen(end);
+    *end++ = ',';
+    dtostrf(sample.stats.mean, 1, 2, end);
+    end += strlen(end);
+    *end++ = ',';
+    dtostrf(sample.stats.count > 1 ? sample.stats.m2 / (sample.stats.count - 1) : 0.0, 1, 1, end);
+    end += strlen(end);
+    *end++ = ',';
+    itoa(sample.stats.min, end, 10);
+    end += strlen(end);
+    *end++ = ',';
+    itoa(sample.stats.max, end, 10);
+    end += strlen(end);
+  }
+
+  *end++ = '\r';
+  *end++ = '\n';
+  return end - line;
+}
+
+uint8_t formatWaveStatus(char *line)
+{
+  // Playback status lines wait for TX room like samples, so a DAC point is never held up by a blocking print
+  if (waveNextPending > 0)
+  {
+    waveNextPending--;
+    strcpy_P(line, PSTR("#next"));
+  }
+  else if (waveUnderrunPending || waveDonePending)
+  {
+    strcpy_P(line, waveDonePending ? PSTR("#done,") : PSTR("#underrun,"));
+    utoa(segmentUnderruns, line + strlen(line), 10);
+    waveUnderrunPending = false;
+    waveDonePending = false;
+  }
+  else
+  {
+    return 0;
+  }
+  char *end = line + strlen(line);
+  *end++ = '\r';
+  *end++ = '\n';
+  return end - line;
+}
+
+void serialService()
+{
+  // Write queued samples only while they fit in the TX buffer, so Serial never blocks
+  while (true)
+  {
+    if (pendingLength == 0)
+    {
+      // Playback status goes ahead of queued samples, the host needs #next to keep the buffers filled
+      pendingLength = formatWaveStatus(pendingLine);
+    }
+    if (pendingLength == 0)
+    {
+      if (queueCount == 0)
       {
-        receiveInProgress = false;
+        break;
       }
+      pendingLength = formatSample(sampleQueue[queueHead], pendingLine);
+      queueHead = (queueHead + 1) % queueSize;
+      queueCount--;
+    }
+    // Lines longer than the TX buffer go out in pieces
+    uint8_t room = min(Serial.availableForWrite(), pendingLength - pendingOffset);
+    if (room == 0)
+    {
+      return;
+    }
+    Serial.write((const uint8_t *)pendingLine + pendingOffset, room);
+    pendingOffset += room;
+    if (pendingOffset < pendingLength)
+    {
+      return;
+    }
+    pendingLength = 0;
+    pendingOffset = 0;
+  }
+
+  // Report losses in band, at most once per second and only when they changed
+  unsigned long timeNow = millis();
+  if (samplesDropped + samplesMerged != samplesReported && timeNow - timeDropReport >= 1000 &&
+      Serial.availableForWrite() >= 40)
+  {
+    Serial.print(F("#drop,"));
+    Serial.print(samplesDropped);
+    Serial.print(',');
+    Serial.print(samplesMerged);
+    Serial.print(',');
+    Serial.println(decimation);
+    samplesReported = samplesDropped + samplesMerged;
+    timeDropReport = timeNow;
+  }
+}
+
+void statsReset(WindowStats &stats)
+{
+  stats.count = 0;
+  stats.mean = 0.0;
+  stats.m2 = 0.0;
+  stats.min = 32767;
+  stats.max = -32768;
+}
+
+void statsUpdate(WindowStats &stats, int16_t code)
+{
+  // Welford's method: mean and variance in one pass without large sums
+  stats.count++;
+  float delta = code - stats.mean;
+  stats.mean += delta / stats.count;
+  stats.m2 += delta * (code - stats.mean);
+  stats.min = min(stats.min, code);
+  stats.max = max(stats.max, code);
+}
+
+void queueSample(Sample sample)
+{
+  // Sweep, event and closed loop records each stand for one DAC step or tag, so they are never averaged;
+  // they are queued or dropped as under drop newest
+  boolean decimated = sample.columns == columnsValue || sample.columns == columnsChannel;
+  if (policyUser == policyDecimate && decimated)
+  {
+    // Average groups of samples into one, the group grows while the host falls behind
+    uint8_t channel = sample.columns == columnsChannel ? sample.extra : 0;
+    decimationSum[channel] += sample.code;
+    decimationCount[channel]++;
+    if (decimationCount[channel] < decimation)
+    {
+      return;
+    }
+    sample.code = (int16_t)(decimationSum[channel] / decimationCount[channel]);
+    if (decimationCount[channel] > 1)
+    {
+      sample.stats.count = 0; // Statistics of the last block do not describe the average
     }
-    else if (dataChar == startMarker)
+    samplesMerged += decimationCount[channel] - 1;
+    decimationSum[channel] = 0;
+    decimationCount[channel] = 0;
+
+    if (queueCount >= queueSize / 2 && decimation < decimationMax)
+    {
+      decimation *= 2;
+      queueIdleRuns = 0;
+    }
+    else if (queueCount == 0 && decimation > 1 && ++queueIdleRuns >= 16)
     {
-      receiveInProgress = true;
+      decimation /= 2;
+      queueIdleRuns = 0;
     }
   }
 
-  // Extract data from transmission
-  int firstDelim = dataStr.indexOf(';');
-  readerSetting = dataStr.substring(0, firstDelim);
+  if (queueCount == queueSize)
+  {
+    samplesDropped++;
+    if (policyUser != policyDropOldest)
+    {
+      serialService();
+      return; // Drop newest
+    }
+    queueHead = (queueHead + 1) % queueSize;
+    queueCount--;
+  }
+
+  sampleQueue[(queueHead + queueCount) % queueSize] = sample;
+  queueCount++;
+  serialService();
+}
+
+WindowStats statsRecord(const WindowStats *stats)
+{
+  // Statistics travel with a record only when enabled
+  WindowStats record;
+  if (statsUser && stats != NULL)
+  {
+    record = *stats;
+  }
+  else
+  {
+    record.count = 0;
+  }
+  return record;
+}
+
+void serialTransmission(unsigned long timeExperiment, int16_t code, uint8_t channel, const WindowStats *stats = NULL)
+{
+  Sample sample = {timeExperiment, code, 0, columnsChannel, (char)channel, statsRecord(stats)};
+  queueSample(sample);
+}
+
+void resetOutput()
+{
+  // Queued samples were taken under the old configuration and cannot be formatted under the new one
+  // They are discarded and reported as dropped; only a partly written line is finished
+  serialCompleteLine();
+  samplesDropped = queueCount + decimationCount[0] + decimationCount[1];
+  queueHead = 0;
+  queueCount = 0;
+  decimation = 1;
+  for (uint8_t channel = 0; channel < 2; channel++)
+  {
+    decimationCount[channel] = 0;
+    decimationSum[channel] = 0;
+  }
+  queueIdleRuns = 0;
+  samplesMerged = 0;
+  samplesReported = 0;
+  waveNextPending = 0;
+  waveUnderrunPending = false;
+  waveDonePending = false;
+}
+
+void serialTransmission(unsigned long timeExperiment, int16_t code, const WindowStats *stats = NULL)
+{
+  Sample sample = {timeExperiment, code, 0, columnsValue, 0, statsRecord(stats)};
+  queueSample(sample);
+}
 
-  int secondDelim = dataStr.indexOf(';', firstDelim + 1);
-  String medianInput = dataStr.substring(firstDelim + 1, secondDelim);
-  medianUser = medianInput.toInt();
+void serialTransmission(unsigned long timeExperiment, int16_t code, char tag)
+{
+  Sample sample = {timeExperiment, code, 0, columnsTag, tag, statsRecord(NULL)};
+  queueSample(sample);
+}
 
-  int thirdDelim = dataStr.indexOf(';', secondDelim + 1);
-  String amplitudeInput = dataStr.substring(secondDelim + 1, thirdDelim);
-  amplitudeUser = amplitudeInput.toInt();
+void serialTransmission(unsigned long timeExperiment, int16_t code, uint16_t indexDAC, uint8_t lag,
+                        const WindowStats *stats = NULL)
+{
+  Sample sample = {timeExperiment, code, indexDAC, columnsIndexLag, (char)lag, statsRecord(stats)};
+  queueSample(sample);
+}
 
-  int fourthDelim = dataStr.indexOf(';', thirdDelim + 1);
-  String frequencyInput = dataStr.substring(thirdDelim + 1, fourthDelim);
-  frequencyUser = frequencyInput.toInt();
-  
-  String debugInput = dataStr.substring(fourthDelim + 1, -1);
-  debug = debugInput.toInt();
+void serialTransmission(unsigned long timeExperiment, int16_t code, uint16_t indexDAC)
+{
+  Sample sample = {timeExperiment, code, indexDAC, columnsIndex, 0, statsRecord(NULL)};
+  queueSample(sample);
+}
+
+void serialLoopStatistics()
+{
+  serialCompleteLine();
+  Serial.print(F("#loop,"));
+  Serial.print(latencyCount);
+  Serial.print(',');
+  Serial.print(latencyMin);
+  Serial.print(',');
+  Serial.print(latencyCount > 0 ? latencySum / latencyCount : 0);
+  Serial.print(',');
+  Serial.print(latencyMax);
+  Serial.print(',');
+  Serial.println(tickOverruns);
+}
+
+void resetLoopStatistics()
+{
+  latencyMin = 0xFFFFFFFF;
+  latencyMax = 0;
+  latencySum = 0;
+  latencyCount = 0;
+  noInterrupts();
+  tickOverruns = 0;
+  interrupts();
+}
+
+void setupControl()
+{
+  setpointCode = currentToCode((float)setpointUser * 1.0e-3); // nA to uA, saturates at the end codes beyond full scale
+  integral = 0;
+
+  // Timer1 in CTC mode, prescaler 64 (4 us per count), so periods up to 262 ms
+  unsigned long period = constrain(controlUser > 0 ? controlUser : 10, 1, 262);
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = (1 << WGM12) | (1 << CS11) | (1 << CS10);
+  TCNT1 = 0;
+  OCR1A = (uint16_t)(period * 250 - 1);
+  TIMSK1 |= (1 << OCIE1A);
+  controlTick = false;
+  interrupts();
 
   if (debug)
   {
-    Serial.print("Setting: "); Serial.println(readerSetting);
-    Serial.print("Median: "); Serial.println(medianUser);
-    Serial.print("Amplitude: "); Serial.println(amplitudeUser);
-    Serial.print("Frequency: "); Serial.println(frequencyUser);
+    Serial.print(F("Setpoint code: ")); Serial.println(setpointCode);
+    Serial.print(F("Timer period: ")); Serial.println(period);
+  }
+
+  ads1115.startADC_Continuous(0); // Latest conversion is always ready to read at a tick
+  resetLoopStatistics();
+}
+
+uint16_t controlStep(int16_t code)
+{
+  // Integer PI controller around the median potential, gains scaled by 256
+  long error = (long)setpointCode - code;
+  long increment = (long)kiUser * error;
+  long output = (long)indexMedian + (((long)kpUser * error + integral) >> 8);
+
+  // Anti-windup: stop integrating while the output is saturated in the direction of the error
+  if (!((output >= (long)dacRes - 1 && increment > 0) || (output <= 0 && increment < 0)))
+  {
+    integral = constrain(integral + increment, -integralLimit, integralLimit);
+  }
+
+  return (uint16_t)constrain(output, 0L, (long)dacRes - 1);
+}
+
+void setupWaveform()
+{
+  segments[0].ready = false;
+  segments[1].ready = false;
+  segmentPlaying = 0;
+  segmentFill = 0;
+  pointPlaying = 0;
+  wavePlaying = false;
+  segmentUnderruns = 0;
+  uploadState = uploadIdle;
+
+  // Request a segment for each free buffer
+  serialCompleteLine();
+  Serial.println(F("#next"));
+  Serial.println(F("#next"));
+}
+
+void serialReadSegment(uint8_t dataByte)
+{
+  // Parse upload frames byte by byte straight into the free buffer
+  WaveformSegment &segment = segments[segmentFill];
+
+  switch (uploadState)
+  {
+  case uploadIdle:
+    if (dataByte == '{')
+    {
+      uploadState = uploadCount;
+    }
+    break;
+  case uploadCount:
+    if (dataByte == 0 || dataByte > segmentCapacity || segment.ready)
+    {
+      uploadPosition = dataByte * sizeof(WaveformPoint) + 3; // Flags, points, checksum and '}'
+      uploadState = uploadSkip;
+      serialCompleteLine();
+      Serial.println(F("#seg,err"));
+      break;
+    }
+    uploadSize = dataByte;
+    uploadSum = dataByte;
+    uploadState = uploadFlags;
+    break;
+  case uploadFlags:
+    segment.flags = dataByte;
+    uploadSum += dataByte;
+    uploadPosition = 0;
+    uploadState = uploadData;
+    break;
+  case uploadData:
+    ((uint8_t *)segment.points)[uploadPosition++] = dataByte;
+    uploadSum += dataByte;
+    if (uploadPosition == uploadSize * sizeof(WaveformPoint))
+    {
+      uploadState = uploadChecksum;
+    }
+    break;
+  case uploadChecksum:
+    uploadState = (dataByte == uploadSum) ? uploadEnd : uploadSkip;
+    if (uploadState == uploadSkip)
+    {
+      uploadPosition = 1; // '}'
+      serialCompleteLine();
+      Serial.println(F("#seg,err"));
+    }
+    break;
+  case uploadEnd:
+    uploadState = uploadIdle;
+    if (dataByte != '}')
+    {
+      serialCompleteLine();
+      Serial.println(F("#seg,err"));
+      break;
+    }
+    segment.count = uploadSize;
+    segment.ready = true;
+    segmentFill ^= 1;
+    serialCompleteLine();
+    Serial.println(F("#seg,ok"));
+    break;
+  case uploadSkip:
+    if (--uploadPosition == 0)
+    {
+      uploadState = uploadIdle;
+    }
+    break;
   }
 }
 
-void serialTransmission(unsigned long timeExperiment, float iSen)
+void serialSync()
 {
-  Serial.print(timeExperiment);
+  // Answer a clock sync ping: time it was received, experiment time (the record time base) and time of the answer
+  unsigned long elapsed = millis() - timeStart;
+  Serial.print(F("#sync,"));
+  Serial.print(syncSequence);
   Serial.print(',');
-  Serial.println(iSen, 3);
+  Serial.print(timeSyncReceived);
+  Serial.print(',');
+  Serial.print(elapsed);
+  Serial.print(',');
+  Serial.println(micros());
+}
+
+void serialHello()
+{
+  // Capabilities as key=value fields, so hosts can skip the ones they do not know
+  Serial.print(F("#hello,version="));
+  Serial.print(protocolVersion);
+  Serial.print(F(",modes="));
+  Serial.print(readerModes);
+  Serial.print(F(",formats=01,inputs=01,filters=01,policies=012"));
+  Serial.print(F(",ranges=6144/4096/2048/1024/512/256,rates=8/16/32/64/128/250/475/860"));
+  Serial.print(F(",queue="));
+  Serial.print(queueSize);
+  Serial.print(F(",segment="));
+  Serial.print(segmentCapacity);
+  Serial.print(F(",tx="));
+  Serial.print(serialTxBuffer);
+  Serial.print(F(",baud="));
+  Serial.print(serialBaud);
+  Serial.println(F(",sync=1"));
+}
+
+void serialReply()
+{
+  // Send the reply to the last host message
+  serialCompleteLine();
+  if (replyRequested == replySync)
+  {
+    serialSync();
+  }
+  else if (replyRequested == replyHello)
+  {
+    serialHello();
+  }
+  else if (replyRequested == replyNak)
+  {
+    Serial.println(F("#nak"));
+  }
+  replyRequested = replyNone;
+}
+
+boolean serialPoll()
+{
+  // Dispatch incoming bytes: waveform segments in waveform mode, setup messages otherwise
+  while (Serial.available() > 0)
+  {
+    uint8_t dataByte = Serial.read();
+    if (readerSetting == "w" && !setupInProgress && (uploadState != uploadIdle || dataByte == '{'))
+    {
+      serialReadSegment(dataByte);
+    }
+    else if (serialReadSetup(dataByte))
+    {
+      return true; // New configuration received
+    }
+    if (replyRequested != replyNone)
+    {
+      serialReply();
+    }
+  }
+  return false;
+}
+
+boolean waitConversion()
+{
+  // Serve the host while the running conversion completes, so pings are stamped and answered as they arrive
+  // Returns true if a new configuration arrived, the conversion is then abandoned
+  while (micros() - timeConversion < conversionMicros)
+  {
+    serialService();
+    if (serialPoll())
+    {
+      return true;
+    }
+  }
+  while (!ads1115.conversionComplete())
+  {
+    if (serialPoll())
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void advanceWaveform()
+{
+  WaveformSegment &segment = segments[segmentPlaying];
+  timePoint += segment.points[pointPlaying].dwell * 10UL; // Schedule from the previous point, not from now
+
+  if (pointPlaying + 1 < segment.count)
+  {
+    pointPlaying++;
+  }
+  else if (segment.flags & segmentFinal)
+  {
+    segment.ready = false;
+    wavePlaying = false;
+    waveDonePending = true;
+    return;
+  }
+  else if (segments[segmentPlaying ^ 1].ready)
+  {
+    segment.ready = false; // Free the buffer for the next upload
+    segmentPlaying ^= 1;
+    pointPlaying = 0;
+    waveNextPending++; // Written by serialService() after the DAC point
+  }
+  else if (segment.flags & segmentRepeat)
+  {
+    pointPlaying = 0;
+  }
+  else
+  {
+    // Next segment is late: hold the last point for another dwell
+    segmentUnderruns++;
+    waveUnderrunPending = true; // Only the latest count is reported
+    return;
+  }
+
+  writeDAC(segments[segmentPlaying].points[pointPlaying].index, chipSelectPin);
+}
+
+void setupEvent()
+{
+  // Window is centered on the median of a block of conversions at the held potential
+  adcArrayIndex = 0;
+  while (adcArrayIndex < 11)
+  {
+    adcArray[adcArrayIndex] = readADC();
+    adcArrayIndex++;
+  }
+  sortArray(adcArray, 11);
+  adcBaseline = adcArray[6];
+
+  // An omitted window would put both thresholds on the baseline and report every conversion
+  int window = windowUser > 0 ? windowUser : 50;
+  long windowCodes = currentToCode((float)window * 1.0e-3); // Window half-width (nA to uA)
+  int16_t thresholdLow = (int16_t)constrain((long)adcBaseline - windowCodes, -32768L, 32767L);
+  int16_t thresholdHigh = (int16_t)constrain((long)adcBaseline + windowCodes, -32768L, 32767L);
+
+  heartbeatPeriod = (heartbeatUser > 0 ? (unsigned long)heartbeatUser : 10UL) * 1000UL;
+
+  if (debug)
+  {
+    Serial.print(F("Baseline: ")); Serial.println(adcBaseline);
+    Serial.print(F("Threshold low: ")); Serial.println(thresholdLow);
+    Serial.print(F("Threshold high: ")); Serial.println(thresholdHigh);
+  }
+
+  // ADS converts continuously and pulls ALERT/RDY low once a conversion leaves the window
+  pinMode(alertPin, INPUT_PULLUP); // ALERT/RDY is open drain
+  ads1115.startComparator_Window(0, thresholdLow, thresholdHigh);
+  ads1115.getConversionResult(); // Clear any alert latched during setup
+  alertFlag = false;
+  attachInterrupt(digitalPinToInterrupt(alertPin), alertISR, FALLING);
+}
+
+void startExperiment()
+{
+  // Release what the previous mode held, store the configuration and apply it
+  detachInterrupt(digitalPinToInterrupt(alertPin));
+  TIMSK1 &= ~(1 << OCIE1A);
+  saveConfig();
+  resetOutput();
+  runningMedian.reset();
+  runningMedian2.reset();
+  setupADC();
+  setupDAC();
+
+  // Tell the host the configuration it sent is in effect, records follow
+  if (ackPending)
+  {
+    serialCompleteLine();
+    Serial.print(F("#ack,"));
+    Serial.println(readerSetting);
+    ackPending = false;
+  }
 }
 
 void setup()
 {
-  // Initialize ADS1115 and set amplifier gain
+  // Initialize ADS1115
   ads1115.begin();
-  ads1115.setGain(GAIN_FOUR);
 
   // Initialize SPI communication (DAC)
   SPI.begin();
@@ -242,55 +1309,320 @@ void setup()
   digitalWrite(chipSelectPin, HIGH);    // Initialize CS pin in default state
   writeDAC(indexGround, chipSelectPin); // Immediately set to ground potential
 
-  Serial.begin(500000); // Set baud rate for serial communication
+  setupMessage.reserve(setupMessageMax); // Allocated once instead of growing a character at a time
+  Serial.begin(serialBaud);              // Set baud rate for serial communication
+  serialHello();                         // Ready for a setup message, the host need not wait a fixed time
 
-  while (Serial.available() < 1)
+  // Boot straight into the stored configuration when autostart is set, otherwise wait for the host
+  if (!(loadConfig() && autostartUser))
   {
-    ; // Delay until incoming message from user
+    while (!serialPoll())
+    {
+      ; // Delay until setup message from user
+    }
   }
 
-  serialReadSetup();
-  setupDAC();
+  startExperiment();
 }
 
 void loop()
 {
+  // Option 1b: hold counter electrode at steady potential, read both differential pairs
+  // Conversions alternate between the pairs back to back, each result fetched as the next pair starts
+  if (readerSetting == "c" && inputUser == 1)
+  {
+    writeDAC(indexMedian, chipSelectPin);
+    uint8_t pair = 0;
+    startDifferential(pair);
+    timeConversion = micros();
+    timeStart = millis();
+    while (true)
+    {
+      adcArrayIndex = 0;
+      statsReset(adcStats);
+      statsReset(adcStats2);
+      while (adcArrayIndex < 11)
+      {
+        if (waitConversion()) // Drain output while the conversion runs
+        {
+          startExperiment();
+          return;
+        }
+        adc = ads1115.getConversionResult();
+        startDifferential(pair ^ 1);
+        timeConversion = micros();
+
+        if (pair == 0)
+        {
+          adcArray[adcArrayIndex] = adc;
+          statsUpdate(adcStats, adc);
+        }
+        else
+        {
+          adcArray2[adcArrayIndex] = adc;
+          statsUpdate(adcStats2, adc);
+          adcArrayIndex++;
+        }
+
+        if (filterUser == 1)
+        {
+          timeExperiment = millis() - timeStart;
+          serialTransmission(timeExperiment, (pair == 0 ? runningMedian : runningMedian2).add(adc), pair);
+        }
+        pair ^= 1;
+      }
+
+      if (filterUser != 1)
+      {
+        timeExperiment = millis() - timeStart;
+        sortArray(adcArray, 11);
+        sortArray(adcArray2, 11);
+        serialTransmission(timeExperiment, adcArray[6], (uint8_t)0, &adcStats); // Print median value of each pair
+        serialTransmission(timeExperiment, adcArray2[6], (uint8_t)1, &adcStats2);
+      }
+
+      if (serialPoll())
+      {
+        startExperiment();
+        return;
+      }
+    }
+  }
+
   // Option 1: hold counter electrode at steady potential
-  if (readerSetting == "c")
+  else if (readerSetting == "c")
   {
     writeDAC(indexMedian, chipSelectPin);
     timeStart = millis();
     while (true)
     {
-      iSenArrayIndex = 0;
-      while (iSenArrayIndex < 11)
+      adcArrayIndex = 0;
+      statsReset(adcStats);
+      while (adcArrayIndex < 11)
       {
-        iSenArray[iSenArrayIndex] = readADC();
-        iSenArrayIndex++;
+        startADC();
+        timeConversion = micros();
+        if (waitConversion()) // Drain output while the conversion runs
+        {
+          startExperiment(); // Live override, restart with the new configuration
+          return;
+        }
+        adcArray[adcArrayIndex] = adc = ads1115.getConversionResult();
+        statsUpdate(adcStats, adcArray[adcArrayIndex]);
+        if (filterUser == 1)
+        {
+          timeExperiment = millis() - timeStart;
+          serialTransmission(timeExperiment, runningMedian.add(adcArray[adcArrayIndex])); // Print running median
+        }
+        adcArrayIndex++;
+      }
+
+      if (filterUser != 1)
+      {
+        timeExperiment = millis() - timeStart;
+        sortArray(adcArray, 11); // Sort array by increasing value
+        serialTransmission(timeExperiment, adcArray[6], &adcStats); // Print median value
+      }
+
+      if (serialPoll())
+      {
+        startExperiment(); // Live override, restart with the new configuration
+        return;
       }
-      timeExperiment = millis() - timeStart;
-      sortArray(iSenArray, 11); // Sort array by increasing value
-      serialTransmission(timeExperiment, iSenArray[6]); // Print median value
     }
   }
 
   // Option 2: sweep counter electrode
+  // Pipelined: while conversion k runs, DAC step k+1 is computed, then written as soon as k completes
   else if (readerSetting == "s")
   {
     timeStart = millis();
+    indexDAC = sweepIndex(0);
+    writeDAC(indexDAC, chipSelectPin);
     while (true)
     {
-      iSenArrayIndex = 0;
-      while (iSenArrayIndex < 11)
+      adcArrayIndex = 0;
+      statsReset(adcStats);
+      while (adcArrayIndex < 11)
       {
+        indexConversion = indexDAC;
+        startADC(); // Start conversion k under DAC step k
+        timeConversion = micros();
+
         timeExperiment = millis() - timeStart;
-        indexDAC = sweepIndex(timeExperiment);
+        indexDAC = sweepIndex(timeExperiment); // Compute DAC step k+1 while conversion k runs
+
+        if (waitConversion()) // Drain output while conversion k runs
+        {
+          startExperiment();
+          return;
+        }
+        adc = ads1115.getConversionResult();
+        writeDAC(indexDAC, chipSelectPin); // Apply step k+1 before converting result k
+
+        adcArray[adcArrayIndex] = adc;
+        statsUpdate(adcStats, adc);
+        if (adcArrayIndex == 5)
+        {
+          indexBlock = indexConversion;
+        }
+        if (filterUser == 1)
+        {
+          // The running median is centred on the middle of its window, so it is labelled with that conversion's index
+          indexHistory[indexHistoryHead] = indexConversion;
+          indexHistoryHead = (indexHistoryHead + 1) % 11;
+          int16_t median = runningMedian.add(adc);
+          uint8_t count = runningMedian.count();
+          uint16_t indexMiddle = indexHistory[(indexHistoryHead + 11 - count + (count - 1) / 2) % 11];
+          serialTransmission(timeExperiment, median, indexMiddle, pipelineLag); // Print running median
+        }
+        adcArrayIndex++;
+      }
+
+      if (filterUser != 1)
+      {
+        sortArray(adcArray, 11); // Sort array by increasing value
+        serialTransmission(timeExperiment, adcArray[6], indexBlock, pipelineLag, &adcStats); // Print median value
+      }
+
+      if (serialPoll())
+      {
+        startExperiment();
+        return;
+      }
+    }
+  }
+
+  // Option 3: hold counter electrode at steady potential, report only window excursions
+  else if (readerSetting == "e")
+  {
+    writeDAC(indexMedian, chipSelectPin);
+    setupEvent();
+    timeStart = millis();
+    timeHeartbeat = 0;
+    while (true)
+    {
+      serialService();
+      timeExperiment = millis() - timeStart;
+      if (alertFlag)
+      {
+        alertFlag = false;
+        adc = ads1115.getConversionResult(); // Reading also releases the latched alert
+        serialTransmission(timeExperiment, adc, 'E');
+        timeHeartbeat = timeExperiment;
+      }
+      else if (timeExperiment - timeHeartbeat >= heartbeatPeriod)
+      {
+        adc = ads1115.getConversionResult();
+        serialTransmission(timeExperiment, adc, 'H');
+        timeHeartbeat = timeExperiment;
+      }
+
+      if (serialPoll())
+      {
+        startExperiment();
+        return;
+      }
+    }
+  }
+
+  // Option 4: closed loop, adjust counter electrode to hold the sensor current at setpoint
+  // Timer1 schedules the control task; serial output follows the DAC write, off the latency path
+  else if (readerSetting == "p")
+  {
+    indexDAC = indexMedian;
+    writeDAC(indexDAC, chipSelectPin);
+    setupControl();
+    timeStart = millis();
+    timeStats = 0;
+    while (true)
+    {
+      if (controlTick)
+      {
+        unsigned long timeTickStart;
+        noInterrupts();
+        controlTick = false;
+        timeTickStart = timeTick;
+        interrupts();
+
+        adc = ads1115.getConversionResult();
+        indexDAC = controlStep(adc);
         writeDAC(indexDAC, chipSelectPin);
-        iSenArray[iSenArrayIndex] = readADC();
-        iSenArrayIndex++;
+
+        unsigned long latency = micros() - timeTickStart;
+        latencyMin = min(latencyMin, latency);
+        latencyMax = max(latencyMax, latency);
+        latencySum += latency;
+        latencyCount++;
+
+        timeExperiment = millis() - timeStart;
+        serialTransmission(timeExperiment, adc, indexDAC);
+        if (timeExperiment - timeStats >= 1000)
+        {
+          serialLoopStatistics();
+          resetLoopStatistics();
+          timeStats = timeExperiment;
+        }
+      }
+      else if (serialPoll())
+      {
+        startExperiment();
+        return;
+      }
+      else
+      {
+        serialService();
+      }
+    }
+  }
+
+  // Option 5: play host-uploaded waveform segments, converting continuously alongside
+  else if (readerSetting == "w")
+  {
+    setupWaveform();
+    while (!segments[0].ready)
+    {
+      if (serialPoll()) // Wait for the first segment
+      {
+        startExperiment();
+        return;
+      }
+    }
+
+    timeStart = millis();
+    wavePlaying = true;
+    timePoint = micros();
+    writeDAC(segments[0].points[0].index, chipSelectPin);
+
+    indexConversion = segments[0].points[0].index;
+    startADC();
+    timeConversion = micros();
+
+    while (true)
+    {
+      if (serialPoll())
+      {
+        startExperiment();
+        return;
+      }
+      serialService();
+
+      if (wavePlaying && micros() - timePoint >= segments[segmentPlaying].points[pointPlaying].dwell * 10UL)
+      {
+        advanceWaveform();
+      }
+
+      // Only poll the ADC once a conversion can have finished, so I2C traffic does not delay DAC points
+      if (micros() - timeConversion >= conversionMicros && ads1115.conversionComplete())
+      {
+        adc = ads1115.getConversionResult();
+        timeExperiment = millis() - timeStart;
+        serialTransmission(timeExperiment, adc, indexConversion);
+
+        indexConversion = segments[segmentPlaying].points[pointPlaying].index;
+        startADC();
+        timeConversion = micros();
       }
-      sortArray(iSenArray, 11); // Sort array by increasing value
-      serialTransmission(timeExperiment, iSenArray[6]); // Print median value
     }
   }
 }
\ No newline at end of file